@@ -3,11 +3,13 @@
 
 #include "root_finder.hpp"
 
+#include <functional>
 #include <vector>
 
 #include <Eigen/Eigen>
 
-// Polynomial order and trajectory dimension are fixed here
+// Default polynomial order and trajectory dimension, see the typedefs at the end
+// PieceT, TrajectoryT and AmTrajT can be instantiated for other ones
 constexpr int TrajOrder = 5;
 constexpr int TrajDim = 3;
 
@@ -18,8 +20,20 @@ typedef Eigen::Matrix<double, TrajDim, TrajOrder> VelCoefficientMat;
 typedef Eigen::Matrix<double, TrajDim, TrajOrder - 1> AccCoefficientMat;
 
 // A single piece of a trajectory, which is indeed a polynomial
-class Piece
+// Dim is the dimension of the space and Order the polynomial order
+template <int Dim, int Order>
+class PieceT
 {
+    static_assert(Dim > 0 && Order >= 2, "a piece needs a dimension and acceleration");
+
+public:
+    typedef Eigen::Matrix<double, Dim, 1> VectorD;
+    // Boundary conditions [p(0),v(0),a(0),p(T),v(T),a(T)] only exist for Order 5
+    typedef Eigen::Matrix<double, Dim, Order + 1> BoundaryCond;
+    typedef Eigen::Matrix<double, Dim, Order + 1> CoefficientMat;
+    typedef Eigen::Matrix<double, Dim, Order> VelCoefficientMat;
+    typedef Eigen::Matrix<double, Dim, Order - 1> AccCoefficientMat;
+
 private:
     // Piece(t) = c5*t^5 + c4*t^4 + ... + c1*t + c0
     // The natural coefficient matrix = [c5,c4,c3,c2,c1,c0]
@@ -30,22 +44,37 @@ private:
     CoefficientMat nCoeffMat;
 
 public:
-    Piece() = default;
+    PieceT() = default;
 
     // Constructor from duration and coefficient
-    Piece(double dur, CoefficientMat coeffs) : duration(dur)
+    PieceT(double dur, CoefficientMat coeffs) : duration(dur)
     {
         double t = 1.0;
-        for (int i = TrajOrder; i >= 0; i--)
+        for (int i = Order; i >= 0; i--)
         {
             nCoeffMat.col(i) = coeffs.col(i) * t;
             t *= dur;
         }
     }
 
+    // Constructor from duration and coefficient matrix in either form
+    // The normalized one, as returned by getCoeffMat(true), is taken as it is
+    PieceT(double dur, const CoefficientMat &coeffs, bool normalized) : duration(dur)
+    {
+        if (normalized)
+        {
+            nCoeffMat = coeffs;
+        }
+        else
+        {
+            *this = PieceT(dur, coeffs);
+        }
+    }
+
     // Constructor from boundary condition and duration
-    Piece(BoundaryCond boundCond, double dur) : duration(dur)
+    PieceT(BoundaryCond boundCond, double dur) : duration(dur)
     {
+        static_assert(Order == 5, "boundary conditions need a quintic piece");
         // The BoundaryCond matrix boundCond = [p(0),v(0),a(0),p(T),v(T),a(T)]
         double t1 = dur;
         double t2 = t1 * t1;
@@ -68,12 +97,12 @@ public:
 
     inline int getDim() const
     {
-        return TrajDim;
+        return Dim;
     }
 
     inline int getOrder() const
     {
-        return TrajOrder;
+        return Order;
     }
 
     inline double getDuration() const
@@ -82,34 +111,29 @@ public:
     }
 
     // Get the position at time t in this piece
-    inline Eigen::Vector3d getPos(double t) const
+    // Horner's scheme, the loop bounds are known at compile time
+    inline VectorD getPos(double t) const
     {
         // Normalize the time
         t /= duration;
-        Eigen::Vector3d pos(0.0, 0.0, 0.0);
-        double tn = 1.0;
-        for (int i = TrajOrder; i >= 0; i--)
+        VectorD pos = nCoeffMat.col(0);
+        for (int i = 1; i <= Order; i++)
         {
-            pos += tn * nCoeffMat.col(i);
-            tn *= t;
+            pos = pos * t + nCoeffMat.col(i);
         }
         // The pos is not affected by normalization
         return pos;
     }
 
     // Get the velocity at time t in this piece
-    inline Eigen::Vector3d getVel(double t) const
+    inline VectorD getVel(double t) const
     {
         // Normalize the time
         t /= duration;
-        Eigen::Vector3d vel(0.0, 0.0, 0.0);
-        double tn = 1.0;
-        int n = 1;
-        for (int i = TrajOrder - 1; i >= 0; i--)
+        VectorD vel = Order * nCoeffMat.col(0);
+        for (int i = 1; i < Order; i++)
         {
-            vel += n * tn * nCoeffMat.col(i);
-            tn *= t;
-            n++;
+            vel = vel * t + (Order - i) * nCoeffMat.col(i);
         }
         // Recover the actual vel
         vel /= duration;
@@ -117,29 +141,42 @@ public:
     }
 
     // Get the acceleration at time t in this piece
-    inline Eigen::Vector3d getAcc(double t) const
+    inline VectorD getAcc(double t) const
     {
         // Normalize the time
         t /= duration;
-        Eigen::Vector3d acc(0.0, 0.0, 0.0);
-        double tn = 1.0;
-        int m = 1;
-        int n = 2;
-        for (int i = TrajOrder - 2; i >= 0; i--)
+        VectorD acc = (Order * (Order - 1)) * nCoeffMat.col(0);
+        for (int i = 1; i < Order - 1; i++)
         {
-            acc += m * n * tn * nCoeffMat.col(i);
-            tn *= t;
-            m++;
-            n++;
+            acc = acc * t + ((Order - i) * (Order - i - 1)) * nCoeffMat.col(i);
         }
         // Recover the actual acc
         acc /= duration * duration;
         return acc;
     }
 
+    // Batch versions of getPos/getVel/getAcc, the i-th result for the time t[i] - offset
+    // is written to out[i]. Horner's scheme runs on a block of samples at once with
+    // every dimension stored contiguously over time, so it is vectorized across time
+    inline void getPos(const double *t, int n, double offset, VectorD *out) const
+    {
+        evaluateBatch<0>(t, n, offset, out);
+    }
+
+    inline void getVel(const double *t, int n, double offset, VectorD *out) const
+    {
+        evaluateBatch<1>(t, n, offset, out);
+    }
+
+    inline void getAcc(const double *t, int n, double offset, VectorD *out) const
+    {
+        evaluateBatch<2>(t, n, offset, out);
+    }
+
     // Get the boundary condition of this piece
     inline BoundaryCond getBoundCond() const
     {
+        static_assert(Order == 5, "boundary conditions need a quintic piece");
         BoundaryCond boundCond;
         boundCond << getPos(0.0), getVel(0.0), getAcc(0.0),
             getPos(duration), getVel(duration), getAcc(duration);
@@ -153,7 +190,7 @@ public:
     {
         CoefficientMat posCoeffsMat;
         double t = 1;
-        for (int i = TrajOrder; i >= 0; i--)
+        for (int i = Order; i >= 0; i--)
         {
             posCoeffsMat.col(i) = nCoeffMat.col(i) / t;
             t *= normalized ? 1.0 : duration;
@@ -170,7 +207,7 @@ public:
         int n = 1;
         double t = 1.0;
         t *= normalized ? 1.0 : duration;
-        for (int i = TrajOrder - 1; i >= 0; i--)
+        for (int i = Order - 1; i >= 0; i--)
         {
             velCoeffMat.col(i) = n * nCoeffMat.col(i) / t;
             n++;
@@ -189,7 +226,7 @@ public:
         int m = 1;
         double t = 1.0;
         t *= normalized ? 1.0 : duration * duration;
-        for (int i = TrajOrder - 2; i >= 0; i--)
+        for (int i = Order - 2; i >= 0; i--)
         {
             accCoeffMat.col(i) = n * m * nCoeffMat.col(i) / t;
             n++;
@@ -203,18 +240,24 @@ public:
     inline double getMaxVelRate() const
     {
         // Compute normalized squared vel norm polynomial coefficient matrix
-        Eigen::MatrixXd nVelCoeffMat = getVelCoeffMat(true);
-        Eigen::VectorXd coeff = RootFinder::polySqr(nVelCoeffMat.row(0)) +
-                                RootFinder::polySqr(nVelCoeffMat.row(1)) +
-                                RootFinder::polySqr(nVelCoeffMat.row(2));
-        int N = coeff.size();
+        VelCoefficientMat nVelCoeffMat = getVelCoeffMat(true);
+        // When no inner control point reaches beyond both ends, the max is at an end
+        double endSqrNorm = std::max(getVel(0.0).squaredNorm(),
+                                     getVel(duration).squaredNorm());
+        double t2 = duration * duration;
+        if (getInnerHullSqrNorm(nVelCoeffMat) <= endSqrNorm * t2)
+        {
+            return sqrt(endSqrNorm);
+        }
+        auto coeff = RootFinder::polySqrSum(nVelCoeffMat);
+        constexpr int N = decltype(coeff)::RowsAtCompileTime;
         int n = N - 1;
         for (int i = 0; i < N; i++)
         {
             coeff(i) *= n;
             n--;
         }
-        if (coeff.head(N - 1).squaredNorm() < DBL_EPSILON)
+        if (coeff.template head<N - 1>().squaredNorm() < DBL_EPSILON)
         {
             return getVel(0.0).norm();
         }
@@ -223,24 +266,25 @@ public:
             // Search an open interval whose boundaries are not zeros
             double l = -0.0625;
             double r = 1.0625;
-            while (fabs(RootFinder::polyVal(coeff.head(N - 1), l)) < DBL_EPSILON)
+            while (fabs(RootFinder::polyVal(coeff.template head<N - 1>(), l)) < DBL_EPSILON)
             {
                 l = 0.5 * l;
             }
-            while (fabs(RootFinder::polyVal(coeff.head(N - 1), r)) < DBL_EPSILON)
+            while (fabs(RootFinder::polyVal(coeff.template head<N - 1>(), r)) < DBL_EPSILON)
             {
                 r = 0.5 * (r + 1.0);
             }
             // Find all stationaries
-            std::set<double> candidates = RootFinder::solvePolynomial(coeff.head(N - 1), l, r,
-                                                                      FLT_EPSILON / duration);
+            RootFinder::RootSet candidates;
+            RootFinder::solvePolynomial(coeff.template head<N - 1>(), l, r,
+                                        FLT_EPSILON / duration, candidates);
 
             // Check boundary points and stationaries within duration
             candidates.insert(0.0);
             candidates.insert(1.0);
             double maxVelRateSqr = -INFINITY;
             double tempNormSqr;
-            for (std::set<double>::const_iterator it = candidates.begin();
+            for (const double *it = candidates.begin();
                  it != candidates.end();
                  it++)
             {
@@ -259,18 +303,24 @@ public:
     inline double getMaxAccRate() const
     {
         // Compute normalized squared acc norm polynomial coefficient matrix
-        Eigen::MatrixXd nAccCoeffMat = getAccCoeffMat(true);
-        Eigen::VectorXd coeff = RootFinder::polySqr(nAccCoeffMat.row(0)) +
-                                RootFinder::polySqr(nAccCoeffMat.row(1)) +
-                                RootFinder::polySqr(nAccCoeffMat.row(2));
-        int N = coeff.size();
+        AccCoefficientMat nAccCoeffMat = getAccCoeffMat(true);
+        // When no inner control point reaches beyond both ends, the max is at an end
+        double endSqrNorm = std::max(getAcc(0.0).squaredNorm(),
+                                     getAcc(duration).squaredNorm());
+        double t2 = duration * duration;
+        if (getInnerHullSqrNorm(nAccCoeffMat) <= endSqrNorm * t2 * t2)
+        {
+            return sqrt(endSqrNorm);
+        }
+        auto coeff = RootFinder::polySqrSum(nAccCoeffMat);
+        constexpr int N = decltype(coeff)::RowsAtCompileTime;
         int n = N - 1;
         for (int i = 0; i < N; i++)
         {
             coeff(i) *= n;
             n--;
         }
-        if (coeff.head(N - 1).squaredNorm() < DBL_EPSILON)
+        if (coeff.template head<N - 1>().squaredNorm() < DBL_EPSILON)
         {
             return getAcc(0.0).norm();
         }
@@ -279,23 +329,24 @@ public:
             // Search an open interval whose boundaries are not zeros
             double l = -0.0625;
             double r = 1.0625;
-            while (fabs(RootFinder::polyVal(coeff.head(N - 1), l)) < DBL_EPSILON)
+            while (fabs(RootFinder::polyVal(coeff.template head<N - 1>(), l)) < DBL_EPSILON)
             {
                 l = 0.5 * l;
             }
-            while (fabs(RootFinder::polyVal(coeff.head(N - 1), r)) < DBL_EPSILON)
+            while (fabs(RootFinder::polyVal(coeff.template head<N - 1>(), r)) < DBL_EPSILON)
             {
                 r = 0.5 * (r + 1.0);
             }
             // Find all stationaries
-            std::set<double> candidates = RootFinder::solvePolynomial(coeff.head(N - 1), l, r,
-                                                                      FLT_EPSILON / duration);
+            RootFinder::RootSet candidates;
+            RootFinder::solvePolynomial(coeff.template head<N - 1>(), l, r,
+                                        FLT_EPSILON / duration, candidates);
             // Check boundary points and stationaries within duration
             candidates.insert(0.0);
             candidates.insert(1.0);
             double maxAccRateSqr = -INFINITY;
             double tempNormSqr;
-            for (std::set<double>::const_iterator it = candidates.begin();
+            for (const double *it = candidates.begin();
                  it != candidates.end();
                  it++)
             {
@@ -321,13 +372,16 @@ public:
         }
         else
         {
-            Eigen::MatrixXd nVelCoeffMat = getVelCoeffMat(true);
-            Eigen::VectorXd coeff = RootFinder::polySqr(nVelCoeffMat.row(0)) +
-                                    RootFinder::polySqr(nVelCoeffMat.row(1)) +
-                                    RootFinder::polySqr(nVelCoeffMat.row(2));
+            VelCoefficientMat nVelCoeffMat = getVelCoeffMat(true);
             // Convert the actual squared maxVelRate to a normalized one
             double t2 = duration * duration;
-            coeff.tail<1>()(0) -= sqrMaxVelRate * t2;
+            // Both ends are within the limit, so the piece is when the inner control points are
+            if (getInnerHullSqrNorm(nVelCoeffMat) < sqrMaxVelRate * t2)
+            {
+                return true;
+            }
+            auto coeff = RootFinder::polySqrSum(nVelCoeffMat);
+            coeff(coeff.size() - 1) -= sqrMaxVelRate * t2;
             // Directly check the root existence in the normalized interval
             return RootFinder::countRoots(coeff, 0.0, 1.0) == 0;
         }
@@ -344,14 +398,17 @@ public:
         }
         else
         {
-            Eigen::MatrixXd nAccCoeffMat = getAccCoeffMat(true);
-            Eigen::VectorXd coeff = RootFinder::polySqr(nAccCoeffMat.row(0)) +
-                                    RootFinder::polySqr(nAccCoeffMat.row(1)) +
-                                    RootFinder::polySqr(nAccCoeffMat.row(2));
+            AccCoefficientMat nAccCoeffMat = getAccCoeffMat(true);
             // Convert the actual squared maxAccRate to a normalized one
             double t2 = duration * duration;
             double t4 = t2 * t2;
-            coeff.tail<1>()(0) -= sqrMaxAccRate * t4;
+            // Both ends are within the limit, so the piece is when the inner control points are
+            if (getInnerHullSqrNorm(nAccCoeffMat) < sqrMaxAccRate * t4)
+            {
+                return true;
+            }
+            auto coeff = RootFinder::polySqrSum(nAccCoeffMat);
+            coeff(coeff.size() - 1) -= sqrMaxAccRate * t4;
             // Directly check the root existence in the normalized interval
             return RootFinder::countRoots(coeff, 0.0, 1.0) == 0;
         }
@@ -363,24 +420,107 @@ public:
         duration /= k;
         return;
     }
+
+private:
+    // Samples evaluated together, fixed size so that Eigen vectorizes every step
+    static constexpr int BatchSize = 16;
+    typedef Eigen::Array<double, BatchSize, 1> BatchArray;
+
+    // n * (n - 1) * ... * (n - r + 1)
+    static constexpr double fallingFactorial(int n, int r)
+    {
+        return r == 0 ? 1.0 : n * fallingFactorial(n - 1, r - 1);
+    }
+
+    // Largest squared norm of the inner Bernstein control points of a normalized
+    // coefficient matrix [c_n,...,c_1,c_0], whose outer ones are p(0) and p(1)
+    // p([0, 1]) lies in the convex hull of all control points, so the norm of
+    // p is bounded by the larger of this and the norms at both ends
+    template <int Cols>
+    static inline double getInnerHullSqrNorm(const Eigen::Matrix<double, Dim, Cols> &nCoeffs)
+    {
+        constexpr int n = Cols - 1;
+        double maxSqrNorm = 0.0;
+        double ratio;
+        VectorD ctrlPt;
+        for (int j = 1; j < n; j++)
+        {
+            // b_j = sum_k C(j,k) / C(n,k) * c_k for k = 0...j
+            ctrlPt = nCoeffs.col(n);
+            ratio = 1.0;
+            for (int k = 1; k <= j; k++)
+            {
+                ratio *= (double)(j - k + 1) / (n - k + 1);
+                ctrlPt += ratio * nCoeffs.col(n - k);
+            }
+            maxSqrNorm = std::max(maxSqrNorm, ctrlPt.squaredNorm());
+        }
+        return maxSqrNorm;
+    }
+
+    // Evaluate the Deriv-th derivative at a batch of times
+    template <int Deriv>
+    inline void evaluateBatch(const double *t, int n, double offset, VectorD *out) const
+    {
+        double scale = 1.0;
+        for (int r = 0; r < Deriv; r++)
+        {
+            scale /= duration;
+        }
+
+        BatchArray tau, val;
+        for (int k = 0; k < n; k += BatchSize)
+        {
+            int m = std::min(BatchSize, n - k);
+            // Normalize the time, the unused tail is evaluated but never written
+            tau.setZero();
+            tau.head(m) = (Eigen::Map<const Eigen::ArrayXd>(t + k, m) - offset) / duration;
+            for (int d = 0; d < Dim; d++)
+            {
+                val.setConstant(fallingFactorial(Order, Deriv) * nCoeffMat(d, 0));
+                for (int i = 1; i <= Order - Deriv; i++)
+                {
+                    val = val * tau + fallingFactorial(Order - i, Deriv) * nCoeffMat(d, i);
+                }
+                for (int j = 0; j < m; j++)
+                {
+                    out[k + j](d) = scale * val(j);
+                }
+            }
+        }
+    }
 };
 
 // A whole trajectory which contains multiple pieces
-class Trajectory
+template <int Dim, int Order>
+class TrajectoryT
 {
+public:
+    typedef PieceT<Dim, Order> Piece;
+    typedef typename Piece::VectorD VectorD;
+    typedef typename Piece::CoefficientMat CoefficientMat;
+
 private:
-    typedef std::vector<Piece> Pieces;
+    typedef std::vector<Piece, Eigen::aligned_allocator<Piece>> Pieces;
 
 public:
 
     Pieces pieces;
-    Trajectory() = default;
+    TrajectoryT() = default;
 
     // Constructor from durations and coefficient matrices
-    Trajectory(const std::vector<double> &durs,
-               const std::vector<CoefficientMat> &coeffMats)
+    TrajectoryT(const std::vector<double> &durs,
+                const std::vector<CoefficientMat> &coeffMats)
+    {
+        assign(durs, coeffMats);
+    }
+
+    // Replace all pieces, the storage of the pieces is reused
+    inline void assign(const std::vector<double> &durs,
+                       const std::vector<CoefficientMat> &coeffMats)
     {
         int N = std::min(durs.size(), coeffMats.size());
+        pieces.clear();
         for (int i = 0; i < N; i++)
         {
             pieces.emplace_back(durs[i], coeffMats[i]);
@@ -431,12 +571,12 @@ public:
         pieces.clear();
     }
 
-    inline Pieces::const_iterator begin() const
+    inline typename Pieces::const_iterator begin() const
     {
         return pieces.begin();
     }
 
-    inline Pieces::const_iterator end() const
+    inline typename Pieces::const_iterator end() const
     {
         return pieces.end();
     }
@@ -457,7 +597,7 @@ public:
     }
 
     // Append another Trajectory at the tail of this trajectory
-    inline void append(const Trajectory &traj)
+    inline void append(const TrajectoryT &traj)
     {
         pieces.insert(pieces.end(), traj.begin(), traj.end());
         return;
@@ -485,28 +625,68 @@ public:
     }
 
     // Get the position at time t of the trajectory
-    inline Eigen::Vector3d getPos(double t) const
+    inline VectorD getPos(double t) const
     {
         int pieceIdx = locatePieceIdx(t);
         return pieces[pieceIdx].getPos(t);
     }
 
     // Get the velocity at time t of the trajectory
-    inline Eigen::Vector3d getVel(double t) const
+    inline VectorD getVel(double t) const
     {
         int pieceIdx = locatePieceIdx(t);
         return pieces[pieceIdx].getVel(t);
     }
 
     // Get the acceleration at time t of the trajectory
-    inline Eigen::Vector3d getAcc(double t) const
+    inline VectorD getAcc(double t) const
     {
         int pieceIdx = locatePieceIdx(t);
         return pieces[pieceIdx].getAcc(t);
     }
 
+    // Sample n times sorted in ascending order, results for times[i] go to pos[i],
+    // vel[i] and acc[i] and any of the three buffers may be nullptr.
+    // A single cursor walks the pieces so the cost is O(n + pieces)
+    inline void sample(const double *times, int n,
+                       VectorD *pos, VectorD *vel, VectorD *acc) const
+    {
+        int N = getPieceNum();
+        int idx = 0, begin = 0, end;
+        double offset = 0.0;
+        while (begin < n && N > 0)
+        {
+            // Same rule as locatePieceIdx, the last piece takes everything after it
+            while (idx < N - 1 && times[begin] > offset + pieces[idx].getDuration())
+            {
+                offset += pieces[idx].getDuration();
+                idx++;
+            }
+            double pieceEnd = offset + pieces[idx].getDuration();
+            for (end = begin + 1;
+                 end < n && (idx == N - 1 || times[end] <= pieceEnd);
+                 end++)
+            {
+            }
+
+            if (pos != nullptr)
+            {
+                pieces[idx].getPos(times + begin, end - begin, offset, pos + begin);
+            }
+            if (vel != nullptr)
+            {
+                pieces[idx].getVel(times + begin, end - begin, offset, vel + begin);
+            }
+            if (acc != nullptr)
+            {
+                pieces[idx].getAcc(times + begin, end - begin, offset, acc + begin);
+            }
+            begin = end;
+        }
+    }
+
     // Get the position at the juncIdx-th waypoint
-    inline Eigen::Vector3d getJuncPos(int juncIdx) const
+    inline VectorD getJuncPos(int juncIdx) const
     {
         if (juncIdx != getPieceNum())
         {
@@ -519,7 +699,7 @@ public:
     }
 
     // Get the velocity at the juncIdx-th waypoint
-    inline Eigen::Vector3d getJuncVel(int juncIdx) const
+    inline VectorD getJuncVel(int juncIdx) const
     {
         if (juncIdx != getPieceNum())
         {
@@ -532,7 +712,7 @@ public:
     }
 
     // Get the acceleration at the juncIdx-th waypoint
-    inline Eigen::Vector3d getJuncAcc(int juncIdx) const
+    inline VectorD getJuncAcc(int juncIdx) const
     {
         if (juncIdx != getPieceNum())
         {
@@ -610,34 +790,35 @@ public:
 class BandedSystem
 {
 public:
+    BandedSystem() : N(0), lowerBw(0), upperBw(0) {}
+
     // The size of A, as well as the lower/upper
     // banded width p/q are needed
     BandedSystem(const int &n, const int &p, const int &q)
-        : N(n), lowerBw(p), upperBw(q),
-          ptrData(nullptr), offset(nullptr)
     {
-        int rows = lowerBw + upperBw + 1;
-        int actualSize = N * rows;
-        ptrData = new double[actualSize];
-        std::fill_n(ptrData, actualSize, 0.0);
-        offset = new double *[rows];
-        double *ptrRow = ptrData;
-        for (int i = 0; i < rows; i++)
-        {
-            offset[i] = ptrRow;
-            ptrRow += N;
-        }
+        create(n, p, q);
     }
 
-    ~BandedSystem()
+    // Resize and zero the system, the storage only grows
+    // so a system kept across calls stops allocating
+    inline void create(const int &n, const int &p, const int &q)
     {
-        if (ptrData != nullptr)
+        N = n;
+        lowerBw = p;
+        upperBw = q;
+        int rows = lowerBw + upperBw + 1;
+        int actualSize = N * rows;
+        if ((int)data.size() < actualSize)
         {
-            delete[] ptrData;
+            data.resize(actualSize);
         }
-        if (offset != nullptr)
+        std::fill_n(data.begin(), actualSize, 0.0);
+        offset.resize(rows);
+        double *ptrRow = data.data();
+        for (int i = 0; i < rows; i++)
         {
-            delete[] offset;
+            offset[i] = ptrRow;
+            ptrRow += N;
         }
     }
 
@@ -645,8 +826,8 @@ private:
     int N;
     int lowerBw;
     int upperBw;
-    double *ptrData;
-    double **offset;
+    std::vector<double> data;
+    std::vector<double *> offset;
 
 public:
     // The band matrix is stored as suggested in "Matrix Computation"
@@ -688,7 +869,8 @@ public:
     // This function solves Ax=b, then stores x in b
     // The input b is required to be N*m, i.e.,
     // m vectors to be solved.
-    inline void solve(Eigen::MatrixXd &b) const
+    template <typename MatrixType>
+    inline void solve(MatrixType &b) const
     {
         int iM;
         for (int j = 0; j <= N - 1; j++)
@@ -711,10 +893,103 @@ public:
     }
 };
 
+// The block tridiagonal system class is used for solving the linear
+// system of optimal coefficients, whose unknowns are the velocity and
+// acceleration at every inner junction. Row i holds 2x2 blocks lower,
+// diag and upper acting on junctions i-1, i and i+1, and the Dim
+// right-hand sides of both rows. Rows are stored contiguously and all
+// right-hand sides are eliminated together by block Thomas elimination,
+// which has O(N) time complexity and, as BandedSystem, does no pivoting
+template <int Dim>
+class BlockTridiagonalSystem
+{
+public:
+    typedef Eigen::Matrix<double, 2, Dim> BlockRhs;
+
+    struct BlockRow
+    {
+        Eigen::Matrix2d lower, diag, upper;
+        BlockRhs rhs;
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    BlockTridiagonalSystem() : N(0) {}
+
+    // Resize the system, the storage only grows so a system kept
+    // across calls stops allocating. Blocks are not reset, every
+    // row has to be written before solve
+    inline void create(const int &n)
+    {
+        N = n;
+        if ((int)rows.size() < N)
+        {
+            rows.resize(N);
+        }
+    }
+
+    inline int size() const
+    {
+        return N;
+    }
+
+    inline BlockRow &operator[](const int &i)
+    {
+        return rows[i];
+    }
+
+    inline const BlockRow &operator[](const int &i) const
+    {
+        return rows[i];
+    }
+
+    // This function solves the system in place, the solution
+    // of the two unknowns of row i is left in rows[i].rhs
+    // Note that the diagonal blocks after elimination MUST BE INVERTIBLE
+    inline void solve()
+    {
+        Eigen::Matrix2d inv;
+        for (int i = 0; i < N; i++)
+        {
+            BlockRow &row = rows[i];
+            if (i > 0)
+            {
+                const BlockRow &prev = rows[i - 1];
+                row.diag.noalias() -= row.lower * prev.upper;
+                row.rhs.noalias() -= row.lower * prev.rhs;
+            }
+            inv = row.diag.inverse();
+            row.upper = inv * row.upper;
+            row.rhs = inv * row.rhs;
+        }
+        for (int i = N - 2; i >= 0; i--)
+        {
+            rows[i].rhs.noalias() -= rows[i].upper * rows[i + 1].rhs;
+        }
+    }
+
+private:
+    int N;
+    std::vector<BlockRow, Eigen::aligned_allocator<BlockRow>> rows;
+};
+
 // The trajectory optimizer to get optimal coefficient and durations at the same time
-class AmTraj
+// The boundary conditions it optimizes over need quintic pieces, only Dim is free
+template <int Dim, int Order = 5>
+class AmTrajT
 {
+    static_assert(Order == 5, "AmTraj only optimizes quintic trajectories");
+
+public:
+    typedef PieceT<Dim, Order> Piece;
+    typedef TrajectoryT<Dim, Order> Trajectory;
+    typedef typename Piece::VectorD VectorD;
+    typedef typename Piece::BoundaryCond BoundaryCond;
+    typedef typename Piece::CoefficientMat CoefficientMat;
+
 private:
+    typedef Eigen::Array<double, Dim, 1> ArrayD;
+    typedef Eigen::Matrix<double, Dim, Eigen::Dynamic> MatrixDX;
+
     // Weights for total duration, acceleration, and jerk
     double wTime;
     double wAcc;
@@ -729,25 +1004,111 @@ private:
     // Acceptable relative tolerance for everything
     double epsilon;
 
+public:
+    // Runs fn(begin, end, worker) over [0, n) in chunks of grain items and returns
+    // when all chunks are done, e.g. a thread pool's parallel for
+    typedef std::function<void(int, int, const std::function<void(int, int, int)> &)> ParallelFor;
+
+private:
+    // Per piece duration optimization is spread with it when set
+    ParallelFor parallelFor;
+    int parallelGrain = 1;
+
+    // Scratch storage reused by every optimization, it only grows with the
+    // largest number of pieces seen so replanning stops allocating in here.
+    // Because of it an AmTraj must not be used by several threads at once
+    struct Workspace
+    {
+        int capacity = 0;
+        Eigen::VectorXd t1, tInv1, tInv2, tInv3, tInv4, tInv5;
+        Eigen::VectorXd cv00, cv01, cv02, cv10, cv11, cv12, cv20, cv21, cv22;
+        Eigen::VectorXd ca00, ca01, ca02, ca10, ca11, ca12, ca20, ca21, ca22;
+        std::vector<Eigen::Matrix<double, 6, 3>,
+                    Eigen::aligned_allocator<Eigen::Matrix<double, 6, 3>>> Minvs;
+        BlockTridiagonalSystem<Dim> A;
+        MatrixDX velsAccs;
+        std::vector<CoefficientMat> coeffMats;
+        std::vector<double> durations, lastDurations;
+        std::vector<VectorD> posVec, velVec, accVec;
+        MatrixDX vels, accs, velsTarget, accsTarget;
+        std::vector<BoundaryCond> boundConds;
+        std::vector<double> bestDurations;
+        // Piece of the previous trajectory that each new piece shares, -1 if none
+        std::vector<int> sharedPieces;
+        // One sub-trajectory per recursion level of recursiveOptimize
+        std::vector<Trajectory> subTrajs;
+    };
+    mutable Workspace ws;
+
+    // Make room for trajectories of up to N pieces
+    void reserveWorkspace(int N) const
+    {
+        if (N <= ws.capacity)
+        {
+            return;
+        }
+        ws.capacity = N;
+        for (Eigen::VectorXd *v : {&ws.t1, &ws.tInv1, &ws.tInv2,
+                                   &ws.tInv3, &ws.tInv4, &ws.tInv5})
+        {
+            v->resize(N);
+        }
+        for (Eigen::VectorXd *v : {&ws.cv00, &ws.cv01, &ws.cv02, &ws.cv10, &ws.cv11,
+                                   &ws.cv12, &ws.cv20, &ws.cv21, &ws.cv22,
+                                   &ws.ca00, &ws.ca01, &ws.ca02, &ws.ca10, &ws.ca11,
+                                   &ws.ca12, &ws.ca20, &ws.ca21, &ws.ca22})
+        {
+            v->resize(N);
+        }
+        ws.Minvs.resize(N);
+        ws.A.create(N);
+        ws.velsAccs.resize(Dim, 2 * N + 2);
+        ws.coeffMats.reserve(N);
+        ws.durations.reserve(N);
+        ws.lastDurations.reserve(N);
+        ws.posVec.reserve(N + 1);
+        ws.velVec.reserve(N + 1);
+        ws.accVec.reserve(N + 1);
+        for (MatrixDX *m : {&ws.vels, &ws.accs, &ws.velsTarget, &ws.accsTarget})
+        {
+            m->resize(Dim, N);
+        }
+        ws.boundConds.reserve(N);
+        ws.bestDurations.reserve(N);
+        ws.sharedPieces.reserve(N);
+        ws.subTrajs.resize(N + 1);
+        for (Trajectory &traj : ws.subTrajs)
+        {
+            traj.pieces.reserve(N);
+        }
+    }
+
 private:
     // Allocate durations for all pieces heuristically
     // Trapezoidal time allocation using maximum vel rate and acc rate
     // The arg conservativeness is used to shrink maximum vel rate and acc rate used
-    std::vector<double> allocateTime(const std::vector<Eigen::Vector3d> &wayPs,
+    std::vector<double> allocateTime(const std::vector<VectorD> &wayPs,
                                      double conservativeness) const
     {
-        int N = (int)(wayPs.size()) - 1;
         std::vector<double> durations;
+        allocateTime(wayPs, conservativeness, durations);
+        return durations;
+    }
+
+    void allocateTime(const std::vector<VectorD> &wayPs,
+                      double conservativeness,
+                      std::vector<double> &durations) const
+    {
+        int N = (int)(wayPs.size()) - 1;
+        durations.clear();
 
         if (N > 0)
         {
-            durations.reserve(N);
-            durations.clear();
 
             double speed = maxVelRate / conservativeness;
             double accRate = maxAccRate / conservativeness;
 
-            Eigen::Vector3d p0, p1;
+            VectorD p0, p1;
             double dtxyz, D, acct, accd, dcct, dccd, t1, t2, t3;
             for (int k = 0; k < N; k++)
             {
@@ -777,184 +1138,193 @@ private:
                 durations.push_back(dtxyz);
             }
         }
-
-        return durations;
     }
 
     // Compute optimal coefficient matrices for all pieces
     // Time allocation, waypoints, and head/tail conditions of traj should be provided
-    std::vector<CoefficientMat> optimizeCoeffs(const std::vector<Eigen::Vector3d> &wayPs,
+    std::vector<CoefficientMat> optimizeCoeffs(const std::vector<VectorD> &wayPs,
                                                const std::vector<double> &durations,
-                                               const Eigen::Vector3d &iniVel,
-                                               const Eigen::Vector3d &iniAcc,
-                                               const Eigen::Vector3d &finVel,
-                                               const Eigen::Vector3d &finAcc) const
+                                               const VectorD &iniVel,
+                                               const VectorD &iniAcc,
+                                               const VectorD &finVel,
+                                               const VectorD &finAcc) const
     {
         std::vector<CoefficientMat> trajCoeffs;
+        optimizeCoeffs(wayPs, durations, iniVel, iniAcc, finVel, finAcc, trajCoeffs);
+        return trajCoeffs;
+    }
+
+    // Same as above, the result is written to trajCoeffs and
+    // all intermediate storage comes from the workspace
+    void optimizeCoeffs(const std::vector<VectorD> &wayPs,
+                        const std::vector<double> &durations,
+                        const VectorD &iniVel,
+                        const VectorD &iniAcc,
+                        const VectorD &finVel,
+                        const VectorD &finAcc,
+                        std::vector<CoefficientMat> &trajCoeffs) const
+    {
+        trajCoeffs.clear();
 
         int N = durations.size();
+        reserveWorkspace(N);
 
-        Eigen::VectorXd t1(N);
+        // Durations and their reciprocal powers, so that filling the system needs no division
+        Eigen::VectorXd &t1 = ws.t1;
+        Eigen::VectorXd &tInv1 = ws.tInv1, &tInv2 = ws.tInv2, &tInv3 = ws.tInv3,
+                        &tInv4 = ws.tInv4, &tInv5 = ws.tInv5;
         for (int i = 0; i < N; i++)
         {
             t1(i) = durations[i];
+            tInv1(i) = 1.0 / t1(i);
+            tInv2(i) = tInv1(i) * tInv1(i);
+            tInv3(i) = tInv2(i) * tInv1(i);
+            tInv4(i) = tInv3(i) * tInv1(i);
+            tInv5(i) = tInv4(i) * tInv1(i);
         }
-        Eigen::VectorXd t2(t1.cwiseProduct(t1)), t3(t2.cwiseProduct(t1));
-        Eigen::VectorXd t4(t3.cwiseProduct(t1)), t5(t4.cwiseProduct(t1));
-        std::vector<Eigen::Matrix<double, 6, 6>> Minvs(N);
+        std::vector<Eigen::Matrix<double, 6, 3>,
+                    Eigen::aligned_allocator<Eigen::Matrix<double, 6, 3>>> &Minvs = ws.Minvs;
 
         for (int i = 0; i < N; i++)
         {
             // Direct computing inverse mapping with no explicit matrix inverse
-            Minvs[i] << -6.0 / t5(i), 15.0 / t4(i), -10 / t3(i), 0.0, 0.0, 1.0,
-                -3.0 / t4(i), 8.0 / t3(i), -6.0 / t2(i), 0.0, 1.0, 0.0,
-                -1.0 / 2.0 / t3(i), 3.0 / 2.0 / t2(i), -3.0 / 2.0 / t1(i), 0.5, 0.0, 0.0,
-                6.0 / t5(i), -15.0 / t4(i), 10.0 / t3(i), 0.0, 0.0, 0.0,
-                -3.0 / t4(i), 7.0 / t3(i), -4.0 / t2(i), 0.0, 0.0, 0.0,
-                1.0 / 2.0 / t3(i), -1.0 / t2(i), 1.0 / 2.0 / t1(i), 0.0, 0.0, 0.0;
+            // Only its first three columns depend on the duration, the others
+            // just pick 0.5 * iniAcc, iniVel and iniPos and are applied below
+            Minvs[i] << -6.0 * tInv5(i), 15.0 * tInv4(i), -10 * tInv3(i),
+                -3.0 * tInv4(i), 8.0 * tInv3(i), -6.0 * tInv2(i),
+                -1.0 / 2.0 * tInv3(i), 3.0 / 2.0 * tInv2(i), -3.0 / 2.0 * tInv1(i),
+                6.0 * tInv5(i), -15.0 * tInv4(i), 10.0 * tInv3(i),
+                -3.0 * tInv4(i), 7.0 * tInv3(i), -4.0 * tInv2(i),
+                1.0 / 2.0 * tInv3(i), -tInv2(i), 1.0 / 2.0 * tInv1(i);
         }
 
-        Eigen::VectorXd cv00(N - 1), cv01(N - 1), cv02(N - 1);
-        Eigen::VectorXd cv10(N - 1), cv11(N - 1), cv12(N - 1);
-        Eigen::VectorXd cv20(N - 1), cv21(N - 1), cv22(N - 1);
-        Eigen::VectorXd ca00(N - 1), ca01(N - 1), ca02(N - 1);
-        Eigen::VectorXd ca10(N - 1), ca11(N - 1), ca12(N - 1);
-        Eigen::VectorXd ca20(N - 1), ca21(N - 1), ca22(N - 1);
+        Eigen::VectorXd &cv00 = ws.cv00, &cv01 = ws.cv01, &cv02 = ws.cv02;
+        Eigen::VectorXd &cv10 = ws.cv10, &cv11 = ws.cv11, &cv12 = ws.cv12;
+        Eigen::VectorXd &cv20 = ws.cv20, &cv21 = ws.cv21, &cv22 = ws.cv22;
+        Eigen::VectorXd &ca00 = ws.ca00, &ca01 = ws.ca01, &ca02 = ws.ca02;
+        Eigen::VectorXd &ca10 = ws.ca10, &ca11 = ws.ca11, &ca12 = ws.ca12;
+        Eigen::VectorXd &ca20 = ws.ca20, &ca21 = ws.ca21, &ca22 = ws.ca22;
 
         // Computed nonzero entries in A and b for linear system Ax=b to be solved
         for (int i = 0; i < N - 1; i++)
         {
-            cv00(i) = wAcc * 120.0 / 7.0 / t2(i) +
-                      wJerk * 720.0 / t4(i);
-            cv01(i) = wAcc * -120.0 / 7.0 * (1.0 / t2(i) - 1.0 / t2(i + 1)) +
-                      wJerk * 720.0 * (1.0 / t4(i + 1) - 1.0 / t4(i));
-            cv02(i) = wAcc * -120.0 / 7.0 / t2(i + 1) +
-                      wJerk * -720.0 / t4(i + 1);
-            cv10(i) = wAcc * 216.0 / 35.0 / t1(i) +
-                      wJerk * 336.0 / t3(i);
-            cv11(i) = wAcc * 384.0 / 35.0 * (1.0 / t1(i) + 1.0 / t1(i + 1)) +
-                      wJerk * 384.0 * (1.0 / t3(i + 1) + 1.0 / t3(i));
-            cv12(i) = wAcc * 216.0 / 35.0 / t1(i + 1) +
-                      wJerk * 336.0 / t3(i + 1);
+            cv00(i) = wAcc * 120.0 / 7.0 * tInv2(i) +
+                      wJerk * 720.0 * tInv4(i);
+            cv01(i) = wAcc * -120.0 / 7.0 * (tInv2(i) - tInv2(i + 1)) +
+                      wJerk * 720.0 * (tInv4(i + 1) - tInv4(i));
+            cv02(i) = wAcc * -120.0 / 7.0 * tInv2(i + 1) +
+                      wJerk * -720.0 * tInv4(i + 1);
+            cv10(i) = wAcc * 216.0 / 35.0 * tInv1(i) +
+                      wJerk * 336.0 * tInv3(i);
+            cv11(i) = wAcc * 384.0 / 35.0 * (tInv1(i) + tInv1(i + 1)) +
+                      wJerk * 384.0 * (tInv3(i + 1) + tInv3(i));
+            cv12(i) = wAcc * 216.0 / 35.0 * tInv1(i + 1) +
+                      wJerk * 336.0 * tInv3(i + 1);
             cv20(i) = wAcc * 8.0 / 35.0 +
-                      wJerk * 48.0 / t2(i);
+                      wJerk * 48.0 * tInv2(i);
             cv21(i) = wAcc * 0.0 +
-                      wJerk * 72.0 * (1.0 / t2(i + 1) - 1.0 / t2(i));
+                      wJerk * 72.0 * (tInv2(i + 1) - tInv2(i));
             cv22(i) = wAcc * -8.0 / 35.0 +
-                      wJerk * -48.0 / t2(i + 1);
-
-            ca00(i) = wAcc * -6.0 / 7.0 / t1(i) +
-                      wJerk * -120.0 / t3(i);
-            ca01(i) = wAcc * 6.0 / 7.0 * (1.0 / t1(i) + 1.0 / t1(i + 1)) +
-                      wJerk * 120.0 * (1.0 / t3(i + 1) + 1.0 / t3(i));
-            ca02(i) = wAcc * -6.0 / 7.0 / t1(i + 1) +
-                      wJerk * -120.0 / t3(i + 1);
+                      wJerk * -48.0 * tInv2(i + 1);
+
+            ca00(i) = wAcc * -6.0 / 7.0 * tInv1(i) +
+                      wJerk * -120.0 * tInv3(i);
+            ca01(i) = wAcc * 6.0 / 7.0 * (tInv1(i) + tInv1(i + 1)) +
+                      wJerk * 120.0 * (tInv3(i + 1) + tInv3(i));
+            ca02(i) = wAcc * -6.0 / 7.0 * tInv1(i + 1) +
+                      wJerk * -120.0 * tInv3(i + 1);
             ca10(i) = wAcc * -8.0 / 35.0 +
-                      wJerk * -48.0 / t2(i);
+                      wJerk * -48.0 * tInv2(i);
             ca11(i) = wAcc * 0.0 +
-                      wJerk * 72.0 * (1.0 / t2(i + 1) - 1.0 / t2(i));
+                      wJerk * 72.0 * (tInv2(i + 1) - tInv2(i));
             ca12(i) = wAcc * 8.0 / 35.0 +
-                      wJerk * 48.0 / t2(i + 1);
-            ca20(i) = wAcc * t1(i) / 35 +
-                      wJerk * -6.0 / t1(i);
+                      wJerk * 48.0 * tInv2(i + 1);
+            ca20(i) = wAcc / 35.0 * t1(i) +
+                      wJerk * -6.0 * tInv1(i);
             ca21(i) = wAcc * 6.0 / 35.0 * (t1(i) + t1(i + 1)) +
-                      wJerk * 18.0 * (1.0 / t1(i + 1) + 1.0 / t1(i));
-            ca22(i) = wAcc * t1(i + 1) / 35.0 +
-                      wJerk * -6.0 / t1(i + 1);
+                      wJerk * 18.0 * (tInv1(i + 1) + tInv1(i));
+            ca22(i) = wAcc / 35.0 * t1(i + 1) +
+                      wJerk * -6.0 * tInv1(i + 1);
         }
 
-        Eigen::MatrixXd VelsAccs(3, 2 * N + 2);
+        Eigen::Ref<MatrixDX> VelsAccs = ws.velsAccs.leftCols(2 * N + 2);
 
         if (N == 1)
         {
             VelsAccs << iniVel, iniAcc, finVel, finAcc;
         }
-        else if (N == 2)
-        {
-            Eigen::MatrixXd A(2, 2), b(2, 3);
-            A.setZero();
-            b.setZero();
-
-            // These lines are too long... Just let it go...
-            A << cv11(0), cv21(0), ca11(0), ca21(0);
-            b << (-cv00(0) * wayPs[0] - cv01(0) * wayPs[1] - cv02(0) * wayPs[2] - cv10(0) * iniVel - cv20(0) * iniAcc - cv12(0) * finVel - cv22(0) * finAcc).transpose(), (-ca00(0) * wayPs[0] - ca01(0) * wayPs[1] - ca02(0) * wayPs[2] - ca10(0) * iniVel - ca20(0) * iniAcc - ca12(0) * finVel - ca22(0) * finAcc).transpose();
-
-            VelsAccs << iniVel, iniAcc, (A.inverse() * b).transpose(), finVel, finAcc;
-        }
         else
         {
-            BandedSystem A(2 * N - 2, 3, 3);
-            Eigen::MatrixXd b(2 * N - 2, 3);
-            b.setZero();
-
-            A(0, 0) = cv11(0);
-            A(0, 1) = cv21(0);
-            A(0, 2) = cv12(0);
-            A(0, 3) = cv22(0);
-            A(1, 0) = ca11(0);
-            A(1, 1) = ca21(0);
-            A(1, 2) = ca12(0);
-            A(1, 3) = ca22(0);
-            A(2 * N - 4, 2 * N - 6) = cv10(N - 2);
-            A(2 * N - 4, 2 * N - 5) = cv20(N - 2);
-            A(2 * N - 4, 2 * N - 4) = cv11(N - 2);
-            A(2 * N - 4, 2 * N - 3) = cv21(N - 2);
-            A(2 * N - 3, 2 * N - 6) = ca10(N - 2);
-            A(2 * N - 3, 2 * N - 5) = ca20(N - 2);
-            A(2 * N - 3, 2 * N - 4) = ca11(N - 2);
-            A(2 * N - 3, 2 * N - 3) = ca21(N - 2);
-
-            b.topLeftCorner<2, 3>() << (-cv00(0) * wayPs[0] - cv01(0) * wayPs[1] - cv02(0) * wayPs[2] - cv10(0) * iniVel - cv20(0) * iniAcc).transpose(), (-ca00(0) * wayPs[0] - ca01(0) * wayPs[1] - ca02(0) * wayPs[2] - ca10(0) * iniVel - ca20(0) * iniAcc).transpose();
-            b.bottomRightCorner<2, 3>() << (-cv00(N - 2) * wayPs[N - 2] - cv01(N - 2) * wayPs[N - 1] - cv02(N - 2) * wayPs[N] - cv12(N - 2) * finVel - cv22(N - 2) * finAcc).transpose(), (-ca00(N - 2) * wayPs[N - 2] - ca01(N - 2) * wayPs[N - 1] - ca02(N - 2) * wayPs[N] - ca12(N - 2) * finVel - ca22(N - 2) * finAcc).transpose();
-            for (int i = 1; i < N - 2; i++)
+            // One block row per inner junction, the head and tail
+            // conditions are known and moved to the right-hand side
+            BlockTridiagonalSystem<Dim> &A = ws.A;
+            A.create(N - 1);
+            for (int i = 0; i < N - 1; i++)
             {
-                A(i * 2, i * 2 - 2) = cv10(i);
-                A(i * 2, i * 2 - 1) = cv20(i);
-                A(i * 2, i * 2) = cv11(i);
-                A(i * 2, i * 2 + 1) = cv21(i);
-                A(i * 2, i * 2 + 2) = cv12(i);
-                A(i * 2, i * 2 + 3) = cv22(i);
-                A(i * 2 + 1, i * 2 - 2) = ca10(i);
-                A(i * 2 + 1, i * 2 - 1) = ca20(i);
-                A(i * 2 + 1, i * 2) = ca11(i);
-                A(i * 2 + 1, i * 2 + 1) = ca21(i);
-                A(i * 2 + 1, i * 2 + 2) = ca12(i);
-                A(i * 2 + 1, i * 2 + 3) = ca22(i);
-
-                b.block<2, 3>(i * 2, 0) << (-cv00(i) * wayPs[i] - cv01(i) * wayPs[i + 1] - cv02(i) * wayPs[i + 2]).transpose(), (-ca00(i) * wayPs[i] - ca01(i) * wayPs[i + 1] - ca02(i) * wayPs[i + 2]).transpose();
+                typename BlockTridiagonalSystem<Dim>::BlockRow &row = A[i];
+                row.lower(0, 0) = cv10(i);
+                row.lower(0, 1) = cv20(i);
+                row.lower(1, 0) = ca10(i);
+                row.lower(1, 1) = ca20(i);
+                row.diag(0, 0) = cv11(i);
+                row.diag(0, 1) = cv21(i);
+                row.diag(1, 0) = ca11(i);
+                row.diag(1, 1) = ca21(i);
+                row.upper(0, 0) = cv12(i);
+                row.upper(0, 1) = cv22(i);
+                row.upper(1, 0) = ca12(i);
+                row.upper(1, 1) = ca22(i);
+
+                row.rhs.row(0) = (-cv00(i) * wayPs[i] - cv01(i) * wayPs[i + 1] - cv02(i) * wayPs[i + 2]).transpose();
+                row.rhs.row(1) = (-ca00(i) * wayPs[i] - ca01(i) * wayPs[i + 1] - ca02(i) * wayPs[i + 2]).transpose();
             }
-
-            // Solve Ax=b using banded LU factorization
-            A.factorizeLU();
-            // The solution is computed in place.
-            A.solve(b);
-
-            VelsAccs << iniVel, iniAcc, b.transpose(), finVel, finAcc;
+            A[0].rhs.row(0) -= (cv10(0) * iniVel + cv20(0) * iniAcc).transpose();
+            A[0].rhs.row(1) -= (ca10(0) * iniVel + ca20(0) * iniAcc).transpose();
+            A[0].lower.setZero();
+            A[N - 2].rhs.row(0) -= (cv12(N - 2) * finVel + cv22(N - 2) * finAcc).transpose();
+            A[N - 2].rhs.row(1) -= (ca12(N - 2) * finVel + ca22(N - 2) * finAcc).transpose();
+            A[N - 2].upper.setZero();
+
+            // Solve Ax=b using block Thomas elimination
+            A.solve();
+
+            VelsAccs.col(0) = iniVel;
+            VelsAccs.col(1) = iniAcc;
+            for (int i = 0; i < N - 1; i++)
+            {
+                VelsAccs.col(2 * i + 2) = A[i].rhs.row(0).transpose();
+                VelsAccs.col(2 * i + 3) = A[i].rhs.row(1).transpose();
+            }
+            VelsAccs.col(2 * N) = finVel;
+            VelsAccs.col(2 * N + 1) = finAcc;
         }
 
         // Recover coefficient matrices for all pieces from their boundary conditions
-        Eigen::MatrixXd PosVelAccPair(3, 6);
+        BoundaryCond PosVelAccPair;
+        CoefficientMat coeffMat;
         for (int i = 0; i < N; i++)
         {
             PosVelAccPair << wayPs[i], VelsAccs.col(2 * i), VelsAccs.col(2 * i + 1),
                 wayPs[i + 1], VelsAccs.col(2 * i + 2), VelsAccs.col(2 * i + 3);
-            trajCoeffs.push_back(PosVelAccPair * Minvs[i]);
+            coeffMat.template leftCols<3>().noalias() = PosVelAccPair * Minvs[i];
+            coeffMat.col(3) = 0.5 * PosVelAccPair.col(2);
+            coeffMat.col(4) = PosVelAccPair.col(1);
+            coeffMat.col(5) = PosVelAccPair.col(0);
+            trajCoeffs.push_back(coeffMat);
         }
-
-        return trajCoeffs;
     }
 
-    // Clip the norm of vec3D if it exceeds (1-eps)*maxNorm
-    inline void clipNorm(Eigen::Vector3d &vec3D, double maxNorm, double eps) const
+    // Clip the norm of vec if it exceeds (1-eps)*maxNorm
+    inline void clipNorm(VectorD &vec, double maxNorm, double eps) const
     {
         const double gamma = 1 - eps;
-        double tempNorm = vec3D.norm();
-        vec3D *= tempNorm > gamma * maxNorm ? gamma * maxNorm / tempNorm : 1.0;
+        double tempNorm = vec.norm();
+        vec *= tempNorm > gamma * maxNorm ? gamma * maxNorm / tempNorm : 1.0;
     }
 
     // Make sure the head/tail conditions of the trajectory satisfy constraints
-    void enforceBoundFeasibility(Eigen::Vector3d &iniVel, Eigen::Vector3d &iniAcc,
-                                 Eigen::Vector3d &finVel, Eigen::Vector3d &finAcc) const
+    void enforceBoundFeasibility(VectorD &iniVel, VectorD &iniAcc,
+                                 VectorD &finVel, VectorD &finAcc) const
     {
         clipNorm(iniVel, maxVelRate, epsilon);
         clipNorm(iniAcc, maxAccRate, epsilon);
@@ -968,8 +1338,13 @@ private:
         int N = traj.getPieceNum();
         if (N > 0)
         {
-            std::vector<Eigen::Vector3d> posVec, velVec, accVec;
-            std::vector<double> durVec;
+            reserveWorkspace(N);
+            std::vector<VectorD> &posVec = ws.posVec, &velVec = ws.velVec, &accVec = ws.accVec;
+            std::vector<double> &durVec = ws.durations;
+            posVec.clear();
+            velVec.clear();
+            accVec.clear();
+            durVec.clear();
 
             posVec.push_back(traj.getJuncPos(0));
             velVec.push_back(traj.getJuncVel(0));
@@ -1039,17 +1414,17 @@ private:
     // Compute the objective of a single piece determined by boundCond and duration
     double evaluateObjective(const BoundaryCond &boundCond, double duration) const
     {
-        Eigen::Array3d iniPos = boundCond.col(0), iniVel = boundCond.col(1), iniAcc = boundCond.col(2);
-        Eigen::Array3d finPos = boundCond.col(3), finVel = boundCond.col(4), finAcc = boundCond.col(5);
+        ArrayD iniPos = boundCond.col(0), iniVel = boundCond.col(1), iniAcc = boundCond.col(2);
+        ArrayD finPos = boundCond.col(3), finVel = boundCond.col(4), finAcc = boundCond.col(5);
 
-        Eigen::VectorXd coeffsAccObjective(5);
+        Eigen::Matrix<double, 5, 1> coeffsAccObjective;
         coeffsAccObjective(0) = (3.0 * iniAcc.square() + iniAcc * finAcc + 3.0 * finAcc.square()).sum();
         coeffsAccObjective(1) = (22.0 * iniAcc * iniVel - 8.0 * finAcc * iniVel + 8.0 * iniAcc * finVel - 22.0 * finAcc * finVel).sum();
         coeffsAccObjective(2) = 6.0 * (32.0 * iniVel.square() + 36.0 * iniVel * finVel + 32.0 * finVel.square() + 5.0 * (iniAcc - finAcc) * (iniPos - finPos)).sum();
         coeffsAccObjective(3) = 600.0 * ((iniVel + finVel) * (iniPos - finPos)).sum();
         coeffsAccObjective(4) = 600.0 * (iniPos - finPos).square().sum();
 
-        Eigen::VectorXd coeffsJerObjective(5);
+        Eigen::Matrix<double, 5, 1> coeffsJerObjective;
         coeffsJerObjective(0) = (3.0 * iniAcc.square() - 2.0 * iniAcc * finAcc + 3.0 * finAcc.square()).sum();
         coeffsJerObjective(1) = 8.0 * (3.0 * iniAcc * iniVel - 2.0 * finAcc * iniVel + 2.0 * iniAcc * finVel - 3.0 * finAcc * finVel).sum();
         coeffsJerObjective(2) = 8.0 * (8.0 * iniVel.square() + 14.0 * iniVel * finVel + 8.0 * finVel.square() + 5.0 * (iniAcc - finAcc) * (iniPos - finPos)).sum();
@@ -1087,13 +1462,16 @@ private:
     void optimizeCoeffsConstrained(Trajectory &traj, int &idxPieceStuck) const
     {
         int N = traj.getPieceNum();
+        reserveWorkspace(N);
 
-        std::vector<double> durVec;
-        std::vector<Eigen::Vector3d> posVec;
-        Eigen::Vector3d velIni, velFin;
-        Eigen::Vector3d accIni, accFin;
-        Eigen::MatrixXd vels(3, N - 1);
-        Eigen::MatrixXd accs(3, N - 1);
+        std::vector<double> &durVec = ws.durations;
+        std::vector<VectorD> &posVec = ws.posVec;
+        VectorD velIni, velFin;
+        VectorD accIni, accFin;
+        Eigen::Ref<MatrixDX> vels = ws.vels.leftCols(N - 1);
+        Eigen::Ref<MatrixDX> accs = ws.accs.leftCols(N - 1);
+        durVec.clear();
+        posVec.clear();
 
         // Recover free boundary conditions Dpk
         durVec.push_back(traj[0].getDuration());
@@ -1112,14 +1490,13 @@ private:
         accFin = traj.getJuncAcc(N);
 
         // Calculate optimal boundary conditions in absence of constraints
-        std::vector<CoefficientMat> targetCoeffsMats = optimizeCoeffs(posVec, durVec, velIni,
-                                                                      accIni, velFin, accFin);
+        optimizeCoeffs(posVec, durVec, velIni, accIni, velFin, accFin, ws.coeffMats);
 
-        traj = Trajectory(durVec, targetCoeffsMats);
+        traj.assign(durVec, ws.coeffMats);
 
         // Extract free part of optimal boundary conditions Dp*
-        Eigen::MatrixXd velsTarget(3, N - 1);
-        Eigen::MatrixXd accsTarget(3, N - 1);
+        Eigen::Ref<MatrixDX> velsTarget = ws.velsTarget.leftCols(N - 1);
+        Eigen::Ref<MatrixDX> accsTarget = ws.accsTarget.leftCols(N - 1);
         for (int i = 0; i < N - 1; i++)
         {
             velsTarget.col(i) = traj.getJuncVel(i + 1);
@@ -1201,9 +1578,12 @@ private:
     void optimizeDurations(Trajectory &traj, bool constrained = true) const
     {
         int N = traj.getPieceNum();
+        reserveWorkspace(N);
 
-        std::vector<BoundaryCond> boundConds;
-        std::vector<double> initialDurations;
+        std::vector<BoundaryCond> &boundConds = ws.boundConds;
+        std::vector<double> &initialDurations = ws.durations;
+        boundConds.clear();
+        initialDurations.clear();
 
         // Backup boundary conditions as durations
         for (int i = 0; i < N; i++)
@@ -1214,140 +1594,185 @@ private:
 
         traj.clear();
 
+        // Every piece only depends on its own boundary condition, so the pieces
+        // can be spread over threads and each result lands in its own slot
+        std::vector<double> &bestDurations = ws.bestDurations;
+        bestDurations.resize(N);
+        auto optimizeRange = [&](int begin, int end, int)
+        {
+            for (int i = begin; i < end; i++)
+            {
+                bestDurations[i] = optimizeDuration(boundConds[i], initialDurations[i],
+                                                    constrained);
+            }
+        };
+        if (parallelFor && N > parallelGrain)
+        {
+            parallelFor(N, parallelGrain, optimizeRange);
+        }
+        else
+        {
+            optimizeRange(0, N, 0);
+        }
+
+        // Construct new pieces with the best durations
+        for (int i = 0; i < N; i++)
+        {
+            traj.emplace_back(boundConds[i], bestDurations[i]);
+        }
+
+        return;
+    }
+
+    // Optimal duration of a single piece with fixed boundary condition
+    // It only touches local storage so that pieces can be optimized concurrently
+    double optimizeDuration(const BoundaryCond &boundCond, double initialDuration,
+                            bool constrained) const
+    {
         Piece piece;
-        Eigen::VectorXd coeffsGradT(7);
+        Eigen::Matrix<double, 7, 1> coeffsGradT;
         double tempAccTerm, tempJerkTerm;
-        Eigen::Array3d posIni, velIni, accIni, posFin, velFin, accFin;
-        for (int i = 0; i < N; i++)
+        ArrayD posIni, velIni, accIni, posFin, velFin, accFin;
+
+        // Calculate the numerator of dJi(T)/dT
+        posIni << boundCond.col(0);
+        velIni << boundCond.col(1);
+        accIni << boundCond.col(2);
+        posFin << boundCond.col(3);
+        velFin << boundCond.col(4);
+        accFin << boundCond.col(5);
+
+        tempAccTerm = (3.0 * accIni.square() + accIni * accFin + 3.0 * accFin.square()).sum();
+        coeffsGradT(0) = wTime * 35.0 + wAcc * tempAccTerm;
+        coeffsGradT(1) = 0.0;
+        tempAccTerm = (32.0 * velIni.square() + 36.0 * velIni * velFin + 32.0 * velFin.square()).sum() +
+                      (5.0 * (accIni - accFin) * (posIni - posFin)).sum();
+        tempJerkTerm = (3.0 * accIni.square() - 2.0 * accIni * accFin + 3.0 * accFin.square()).sum();
+        coeffsGradT(2) = -3.0 * (2.0 * wAcc * tempAccTerm + 35.0 * wJerk * tempJerkTerm);
+        tempAccTerm = ((velIni + velFin) * (posIni - posFin)).sum();
+        tempJerkTerm = ((-3.0 * accIni + 2.0 * accFin) * velIni + (-2.0 * accIni + 3.0 * accFin) * velFin).sum();
+        coeffsGradT(3) = 240.0 * (-5.0 * wAcc * tempAccTerm + 7.0 * wJerk * tempJerkTerm);
+        tempAccTerm = (posIni - posFin).square().sum();
+        tempJerkTerm = (8.0 * velIni.square() + 14.0 * velIni * velFin + 8.0 * velFin.square()).sum() +
+                       (5.0 * (accIni - accFin) * (posIni - posFin)).sum();
+        coeffsGradT(4) = -360.0 * (5.0 * wAcc * tempAccTerm + 7.0 * wJerk * tempJerkTerm);
+        coeffsGradT(5) = -100800.0 * wJerk * ((velIni + velFin) * (posIni - posFin)).sum();
+        coeffsGradT(6) = -126000.0 * wJerk * (posIni - posFin).square().sum();
+
+        // Compute all stationaries in which the optimal duration locates
+        RootFinder::RootSet stationaries;
+        RootFinder::solvePolynomial(coeffsGradT, 0.0, INFINITY,
+                                    initialDuration * epsilon * epsilon, stationaries);
+
+        RootFinder::RootSet candidates;
+        if (constrained)
         {
-            // Calculate the numerator of dJi(T)/dT
-            posIni << boundConds[i].col(0);
-            velIni << boundConds[i].col(1);
-            accIni << boundConds[i].col(2);
-            posFin << boundConds[i].col(3);
-            velFin << boundConds[i].col(4);
-            accFin << boundConds[i].col(5);
-
-            tempAccTerm = (3.0 * accIni.square() + accIni * accFin + 3.0 * accFin.square()).sum();
-            coeffsGradT(0) = wTime * 35.0 + wAcc * tempAccTerm;
-            coeffsGradT(1) = 0.0;
-            tempAccTerm = (32.0 * velIni.square() + 36.0 * velIni * velFin + 32.0 * velFin.square()).sum() +
-                          (5.0 * (accIni - accFin) * (posIni - posFin)).sum();
-            tempJerkTerm = (3.0 * accIni.square() - 2.0 * accIni * accFin + 3.0 * accFin.square()).sum();
-            coeffsGradT(2) = -3.0 * (2.0 * wAcc * tempAccTerm + 35.0 * wJerk * tempJerkTerm);
-            tempAccTerm = ((velIni + velFin) * (posIni - posFin)).sum();
-            tempJerkTerm = ((-3.0 * accIni + 2.0 * accFin) * velIni + (-2.0 * accIni + 3.0 * accFin) * velFin).sum();
-            coeffsGradT(3) = 240.0 * (-5.0 * wAcc * tempAccTerm + 7.0 * wJerk * tempJerkTerm);
-            tempAccTerm = (posIni - posFin).square().sum();
-            tempJerkTerm = (8.0 * velIni.square() + 14.0 * velIni * velFin + 8.0 * velFin.square()).sum() +
-                           (5.0 * (accIni - accFin) * (posIni - posFin)).sum();
-            coeffsGradT(4) = -360.0 * (5.0 * wAcc * tempAccTerm + 7.0 * wJerk * tempJerkTerm);
-            coeffsGradT(5) = -100800.0 * wJerk * ((velIni + velFin) * (posIni - posFin)).sum();
-            coeffsGradT(6) = -126000.0 * wJerk * (posIni - posFin).square().sum();
-
-            // Compute all stationaries in which the optimal duration locates
-            std::set<double> stationaries;
-            stationaries = RootFinder::solvePolynomial(coeffsGradT, 0.0, INFINITY,
-                                                       initialDurations[i] * epsilon * epsilon);
-
-            std::set<double> candidates;
-            if (constrained)
+            // When constraints are considered, duration T~ should be found where some constraints are tight
+            RootFinder::RootSet infeasibleStationaries, feasibleStationaries;
+            for (auto it = stationaries.begin(); it != stationaries.end(); it++)
             {
-                // When constraints are considered, duration T~ should be found where some constraints are tight
-                std::set<double> infeasibleStationaries, feasibleStationaries;
-                for (auto it = stationaries.begin(); it != stationaries.end(); it++)
+                piece = Piece(boundCond, *it);
+                if (piece.checkMaxAccRate(maxAccRate) &&
+                    piece.checkMaxVelRate(maxVelRate))
                 {
-                    piece = Piece(boundConds[i], *it);
-                    if (piece.checkMaxAccRate(maxAccRate) &&
-                        piece.checkMaxVelRate(maxVelRate))
-                    {
-                        feasibleStationaries.insert(*it);
-                    }
-                    else
-                    {
-                        infeasibleStationaries.insert(*it);
-                    }
+                    feasibleStationaries.insert(*it);
+                }
+                else
+                {
+                    infeasibleStationaries.insert(*it);
                 }
+            }
 
-                // T~ must be located between a feasible stationary and neighbouring feasible one
-                candidates = feasibleStationaries;
-                if (infeasibleStationaries.size() != 0)
+            // T~ must be located between a feasible stationary and neighbouring feasible one
+            candidates = feasibleStationaries;
+            if (infeasibleStationaries.size() != 0)
+            {
+                double lbound = infeasibleStationaries.back();
+                double rbound;
+                if (feasibleStationaries.size() == 0)
                 {
-                    double lbound = *(--infeasibleStationaries.end());
-                    double rbound;
-                    if (feasibleStationaries.size() == 0)
-                    {
-                        rbound = initialDurations[i];
-                    }
-                    else
-                    {
-                        rbound = *(feasibleStationaries.begin());
-                    }
+                    rbound = initialDuration;
+                }
+                else
+                {
+                    rbound = feasibleStationaries.front();
+                }
 
-                    int maxIts = std::max(-(int)log2(epsilon), 0) + 1;
-                    double mid;
-                    piece = Piece(boundConds[i], rbound);
-                    if (piece.checkMaxAccRate(maxAccRate) &&
-                        piece.checkMaxVelRate(maxVelRate))
+                int maxIts = std::max(-(int)log2(epsilon), 0) + 1;
+                double mid;
+                piece = Piece(boundCond, rbound);
+                if (piece.checkMaxAccRate(maxAccRate) &&
+                    piece.checkMaxVelRate(maxVelRate))
+                {
+                    for (int j = 0; j < maxIts; j++)
                     {
-                        for (int j = 0; j < maxIts; j++)
+                        mid = (lbound + rbound) / 2.0;
+                        piece = Piece(boundCond, mid);
+                        if (piece.checkMaxAccRate(maxAccRate) &&
+                            piece.checkMaxVelRate(maxVelRate))
+                        {
+                            rbound = mid;
+                        }
+                        else
                         {
-                            mid = (lbound + rbound) / 2.0;
-                            piece = Piece(boundConds[i], mid);
-                            if (piece.checkMaxAccRate(maxAccRate) &&
-                                piece.checkMaxVelRate(maxVelRate))
-                            {
-                                rbound = mid;
-                            }
-                            else
-                            {
-                                lbound = mid;
-                            }
+                            lbound = mid;
                         }
-                        // T~ is also candidates when constraints exist
-                        candidates.insert(rbound);
                     }
+                    // T~ is also candidates when constraints exist
+                    candidates.insert(rbound);
                 }
             }
-            else
-            {
-                // When constraints do not exist, only stationaris are candidates
-                candidates = stationaries;
-            }
+        }
+        else
+        {
+            // When constraints do not exist, only stationaris are candidates
+            candidates = stationaries;
+        }
 
-            // We have to compare all candidates, even when constraints do not exist
-            // Because the rational function Ji(T) can have peaks and valleys,
-            // especially when initial guess is bad or duration weight is relative low
-            candidates.insert(initialDurations[i]);
-            double curBestCost = INFINITY;
-            double tempCost;
-            double curBestDuration = initialDurations[i];
-            for (auto it = candidates.begin(); it != candidates.end(); it++)
+        // We have to compare all candidates, even when constraints do not exist
+        // Because the rational function Ji(T) can have peaks and valleys,
+        // especially when initial guess is bad or duration weight is relative low
+        candidates.insert(initialDuration);
+        double curBestCost = INFINITY;
+        double tempCost;
+        double curBestDuration = initialDuration;
+        for (auto it = candidates.begin(); it != candidates.end(); it++)
+        {
+            tempCost = evaluateObjective(boundCond, *it);
+            if (tempCost < curBestCost)
             {
-                tempCost = evaluateObjective(boundConds[i], *it);
-                if (tempCost < curBestCost)
-                {
-                    curBestCost = tempCost;
-                    curBestDuration = *it;
-                }
+                curBestCost = tempCost;
+                curBestDuration = *it;
             }
-
-            // Construct a new piece with the best duration
-            traj.emplace_back(boundConds[i], curBestDuration);
         }
 
-        return;
+        return curBestDuration;
     }
 
     // Recursively optimized the initial feasible trajectory
     // Constraints are considered
     Trajectory recursiveOptimize(Trajectory traj) const
+    {
+        reserveWorkspace(traj.getPieceNum());
+        recursiveOptimize(traj, 0);
+        return traj;
+    }
+
+    // In place version, sub-trajectories of each recursion level live in the workspace
+    // The number of pieces never changes so results are written back piece by piece
+    void recursiveOptimize(Trajectory &traj, int depth) const
     {
         if (traj.getPieceNum() > 0)
         {
             bool inTol;
             int idxPieceStuck = -1;
-            Trajectory lastTraj = traj;
+            // Only the durations of the last iteration are compared
+            std::vector<double> &lastDurations = ws.lastDurations;
+            lastDurations.clear();
+            for (int j = 0; j < traj.getPieceNum(); j++)
+            {
+                lastDurations.push_back(traj[j].getDuration());
+            }
             for (int i = 0; i < maxIterations; i++)
             {
                 // Constrained alternating minimization between durations and coeffMats
@@ -1359,8 +1784,8 @@ private:
                 double diffDuration;
                 for (int j = 0; j < traj.getPieceNum(); j++)
                 {
-                    diffDuration = fabs(traj[j].getDuration() - lastTraj[j].getDuration());
-                    if (diffDuration > lastTraj[j].getDuration() * epsilon)
+                    diffDuration = fabs(traj[j].getDuration() - lastDurations[j]);
+                    if (diffDuration > lastDurations[j] * epsilon)
                     {
                         inTol = false;
                         break;
@@ -1371,7 +1796,10 @@ private:
                     break;
                 }
 
-                lastTraj = traj;
+                for (int j = 0; j < traj.getPieceNum(); j++)
+                {
+                    lastDurations[j] = traj[j].getDuration();
+                }
             }
             // Although objectives are much the same, we find that the minimum
             // in "Coeffs Direction" is smoother than the one in "Durations Direction"
@@ -1381,57 +1809,61 @@ private:
             // When there is piece stuck, call this func on sub-trajectories
             if (idxPieceStuck != -1)
             {
-                Trajectory subTraj, tempTraj;
-                Eigen::Vector3d tempVel, tempAcc;
+                Trajectory &subTraj = ws.subTrajs[depth];
 
                 if (idxPieceStuck != 0)
                 {
+                    subTraj.clear();
                     for (int i = 0; i < idxPieceStuck; i++)
                     {
-                        tempTraj.emplace_back(traj[i]);
+                        subTraj.emplace_back(traj[i]);
+                    }
+                    recursiveOptimize(subTraj, depth + 1);
+                    for (int i = 0; i < idxPieceStuck; i++)
+                    {
+                        traj[i] = subTraj[i];
                     }
-                    tempTraj = recursiveOptimize(tempTraj);
                 }
 
-                tempTraj.emplace_back(traj[idxPieceStuck]);
-
                 if (idxPieceStuck != traj.getPieceNum() - 1)
                 {
+                    subTraj.clear();
                     for (int i = idxPieceStuck + 1; i < traj.getPieceNum(); i++)
                     {
                         subTraj.emplace_back(traj[i]);
                     }
-                    subTraj = recursiveOptimize(subTraj);
+                    recursiveOptimize(subTraj, depth + 1);
+                    for (int i = idxPieceStuck + 1; i < traj.getPieceNum(); i++)
+                    {
+                        traj[i] = subTraj[i - idxPieceStuck - 1];
+                    }
                 }
-                tempTraj.append(subTraj);
-
-                return tempTraj;
-            }
-            else
-            {
-                return traj;
             }
         }
-        else
-        {
-            return traj;
-        }
     }
 
 public:
     // Compulsory constructor from all necessary parameters
-    AmTraj(double wT, double wA, double wJ,
+    AmTrajT(double wT, double wA, double wJ,
            double mVr, double mAr, int mIts, double eps)
         : wTime(wT), wAcc(wA), wJerk(wJ),
           maxVelRate(mVr), maxAccRate(mAr),
           maxIterations(mIts), epsilon(eps) {}
 
+    // Optimize the durations of pieces in parallel, grain pieces per task
+    // Results do not depend on how the pieces are split, pass an empty one to go serial
+    void setParallelFor(const ParallelFor &pf, int grain)
+    {
+        parallelFor = pf;
+        parallelGrain = std::max(grain, 1);
+    }
+
     // Generate trajectory with optimal coefficients
     // Durations are allocated heuristically and scaled to satisfy constraints
     // Only applies to rest-to-rest trajectories
-    Trajectory genOptimalTrajDC(const std::vector<Eigen::Vector3d> &wayPs,
-                                Eigen::Vector3d iniVel, Eigen::Vector3d iniAcc,
-                                Eigen::Vector3d finVel, Eigen::Vector3d finAcc) const
+    Trajectory genOptimalTrajDC(const std::vector<VectorD> &wayPs,
+                                VectorD iniVel, VectorD iniAcc,
+                                VectorD finVel, VectorD finAcc) const
     {
         std::vector<double> durations = allocateTime(wayPs, 1.0);
         std::vector<CoefficientMat> coeffMats = optimizeCoeffs(wayPs, durations,
@@ -1451,9 +1883,9 @@ public:
 
     // Generate trajectory with optimal coefficients and optimal durations
     // Constraints are not considered
-    Trajectory genOptimalTrajDT(const std::vector<Eigen::Vector3d> &wayPs,
-                                Eigen::Vector3d iniVel, Eigen::Vector3d iniAcc,
-                                Eigen::Vector3d finVel, Eigen::Vector3d finAcc) const
+    Trajectory genOptimalTrajDT(const std::vector<VectorD> &wayPs,
+                                VectorD iniVel, VectorD iniAcc,
+                                VectorD finVel, VectorD finAcc) const
     {
         std::vector<double> durations = allocateTime(wayPs, 1.0);
         std::vector<CoefficientMat> coeffMats;
@@ -1504,23 +1936,144 @@ public:
 
     // Generate trajectory with optimal coefficients and best durations
     // Constraints are satisfied all the time
-    Trajectory genOptimalTrajDTC(const std::vector<Eigen::Vector3d> &wayPs,
-                                 Eigen::Vector3d iniVel, Eigen::Vector3d iniAcc,
-                                 Eigen::Vector3d finVel, Eigen::Vector3d finAcc) const
+    Trajectory genOptimalTrajDTC(const std::vector<VectorD> &wayPs,
+                                 VectorD iniVel, VectorD iniAcc,
+                                 VectorD finVel, VectorD finAcc) const
     {
+        Trajectory traj;
+        genOptimalTrajDTC(wayPs, iniVel, iniAcc, finVel, finAcc, traj);
+        return traj;
+    }
+
+    // Same as above, the result is written to traj whose storage is reused
+    // Keeping both traj and this AmTraj across calls avoids heap allocations
+    // here once the largest number of waypoints has been seen
+    void genOptimalTrajDTC(const std::vector<VectorD> &wayPs,
+                           VectorD iniVel, VectorD iniAcc,
+                           VectorD finVel, VectorD finAcc,
+                           Trajectory &traj) const
+    {
+        reserveWorkspace((int)wayPs.size() - 1);
         enforceBoundFeasibility(iniVel, iniAcc, finVel, finAcc);
-        std::vector<double> durations = allocateTime(wayPs, 1.0);
-        std::vector<CoefficientMat> coeffMats = optimizeCoeffs(wayPs, durations,
-                                                               iniVel, iniAcc,
-                                                               finVel, finAcc);
-        Trajectory traj(durations, coeffMats);
+        allocateTime(wayPs, 1.0, ws.durations);
+        optimizeCoeffs(wayPs, ws.durations,
+                       iniVel, iniAcc,
+                       finVel, finAcc, ws.coeffMats);
+        traj.assign(ws.durations, ws.coeffMats);
 
         if (enforceIniTrajFeasibility(traj, maxIterations))
         {
-            traj = recursiveOptimize(traj);
+            recursiveOptimize(traj, 0);
         }
+    }
+
+    // Generate trajectory with optimal coefficients and best durations,
+    // warm started from prevTraj, the result of the previous plan
+    // Pieces whose two waypoints are also consecutive waypoints of prevTraj
+    // start from its durations and junction derivatives, the rest from the
+    // heuristic allocation. When consecutive plans mostly share the route the
+    // alternating minimization starts close to its optimum and stops early
+    Trajectory genOptimalTrajDTC(const Trajectory &prevTraj,
+                                 const std::vector<VectorD> &wayPs,
+                                 VectorD iniVel, VectorD iniAcc,
+                                 VectorD finVel, VectorD finAcc) const
+    {
+        Trajectory traj;
+        genOptimalTrajDTC(prevTraj, wayPs, iniVel, iniAcc, finVel, finAcc, traj);
         return traj;
     }
+
+    // Same as above, the result is written to traj whose storage is reused
+    // traj and prevTraj must not be the same object
+    void genOptimalTrajDTC(const Trajectory &prevTraj,
+                           const std::vector<VectorD> &wayPs,
+                           VectorD iniVel, VectorD iniAcc,
+                           VectorD finVel, VectorD finAcc,
+                           Trajectory &traj) const
+    {
+        int N = (int)wayPs.size() - 1;
+        reserveWorkspace(N);
+        enforceBoundFeasibility(iniVel, iniAcc, finVel, finAcc);
+        allocateTime(wayPs, 1.0, ws.durations);
+
+        // Match the new pieces against the previous ones, both routes are
+        // ordered so the search carries on after the last match
+        const double tol = 1.0e-6;
+        std::vector<int> &shared = ws.sharedPieces;
+        shared.assign(std::max(N, 0), -1);
+        int M = prevTraj.getPieceNum();
+        int next = 0;
+        bool any = false;
+        for (int i = 0; i < N; i++)
+        {
+            for (int j = next; j < M; j++)
+            {
+                if ((prevTraj.getJuncPos(j) - wayPs[i]).norm() < tol &&
+                    (prevTraj.getJuncPos(j + 1) - wayPs[i + 1]).norm() < tol)
+                {
+                    shared[i] = j;
+                    ws.durations[i] = prevTraj[j].getDuration();
+                    next = j + 1;
+                    any = true;
+                    break;
+                }
+            }
+        }
+
+        optimizeCoeffs(wayPs, ws.durations,
+                       iniVel, iniAcc,
+                       finVel, finAcc, ws.coeffMats);
+        traj.assign(ws.durations, ws.coeffMats);
+
+        // Inner junctions of shared pieces take the previous derivatives,
+        // the head and tail conditions are given and stay as they are
+        if (any)
+        {
+            std::vector<VectorD> &velVec = ws.velVec, &accVec = ws.accVec;
+            velVec.clear();
+            accVec.clear();
+            for (int i = 0; i <= N; i++)
+            {
+                velVec.push_back(traj.getJuncVel(i));
+                accVec.push_back(traj.getJuncAcc(i));
+            }
+            for (int i = 0; i < N; i++)
+            {
+                if (shared[i] < 0)
+                {
+                    continue;
+                }
+                if (i > 0)
+                {
+                    velVec[i] = prevTraj.getJuncVel(shared[i]);
+                    accVec[i] = prevTraj.getJuncAcc(shared[i]);
+                }
+                if (i < N - 1)
+                {
+                    velVec[i + 1] = prevTraj.getJuncVel(shared[i] + 1);
+                    accVec[i + 1] = prevTraj.getJuncAcc(shared[i] + 1);
+                }
+            }
+
+            BoundaryCond boundCond;
+            for (int i = 0; i < N; i++)
+            {
+                boundCond << wayPs[i], velVec[i], accVec[i],
+                    wayPs[i + 1], velVec[i + 1], accVec[i + 1];
+                traj[i] = Piece(boundCond, ws.durations[i]);
+            }
+        }
+
+        if (enforceIniTrajFeasibility(traj, maxIterations))
+        {
+            recursiveOptimize(traj, 0);
+        }
+    }
 };
 
+// The 3D quintic instantiation used by the planner
+typedef PieceT<TrajDim, TrajOrder> Piece;
+typedef TrajectoryT<TrajDim, TrajOrder> Trajectory;
+typedef AmTrajT<TrajDim, TrajOrder> AmTraj;
+
 #endif
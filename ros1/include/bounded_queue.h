@@ -0,0 +1,86 @@
+/*
+* bounded_queue.h
+*
+* ---------------------------------------------------------------------
+* Copyright (C) 2022 Matthew (matthewoots at gmail.com)
+*
+*  This program is free software; you can redistribute it and/or
+*  modify it under the terms of the GNU General Public License
+*  as published by the Free Software Foundation; either version 2
+*  of the License, or (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+* ---------------------------------------------------------------------
+*/
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+/**
+ * @brief Queue between two pipeline stages
+ * When the queue is full the oldest item is dropped, a planning stage
+ * only ever cares about the newest data
+**/
+template <typename T>
+class bounded_queue
+{
+    public:
+
+        explicit bounded_queue(size_t c = 1) : capacity(c > 0 ? c : 1), closed(false) {}
+
+        /** @brief Returns false if an older item had to be dropped **/
+        bool push(T item)
+        {
+            bool dropped = false;
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                if (items.size() >= capacity)
+                {
+                    items.pop_front();
+                    dropped = true;
+                }
+                items.push_back(std::move(item));
+            }
+            queue_cv.notify_one();
+            return !dropped;
+        }
+
+        /** @brief Blocks until an item is available, returns false once closed **/
+        bool pop(T &item)
+        {
+            std::unique_lock<std::mutex> lock(queue_mutex);
+            queue_cv.wait(lock, [this] { return closed || !items.empty(); });
+            if (closed)
+                return false;
+            item = std::move(items.front());
+            items.pop_front();
+            return true;
+        }
+
+        /** @brief Wake up and release every consumer **/
+        void close()
+        {
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                closed = true;
+                items.clear();
+            }
+            queue_cv.notify_all();
+        }
+
+    private:
+
+        size_t capacity;
+        bool closed;
+        std::deque<T> items;
+        std::mutex queue_mutex;
+        std::condition_variable queue_cv;
+};
+
+#endif
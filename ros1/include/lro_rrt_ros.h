@@ -20,10 +20,21 @@
 
 #include "lro_rrt_server.h"
 #include "am_traj.hpp"
+#include "sensor_map.h"
+#include "map_store.h"
+#include "ring_buffer_map.h"
+#include "worker_pool.h"
+#include "snapshot.h"
+#include "bounded_queue.h"
+#include "trajectory_timeline.h"
+#include "trajectory_log.h"
+#include "path_selection.h"
 
 #include <string>
 #include <thread>   
 #include <mutex>
+#include <memory>
+#include <atomic>
 #include <iostream>
 #include <iostream>
 #include <math.h>
@@ -42,6 +53,7 @@
 
 #include <sensor_msgs/PointCloud2.h>
 #include <sensor_msgs/point_cloud_conversion.h>
+#include <sensor_msgs/point_cloud2_iterator.h>
 
 #include <visualization_msgs/Marker.h>
 
@@ -79,6 +91,7 @@ class lro_rrt_ros_node
             double hfov;
             double s_m_s; // sliding map size
             double s_m_r; // sliding map resolution
+            int p_s; // rays per side of a ray packet
         };
 
         struct am_trajectory_parameters
@@ -90,13 +103,15 @@ class lro_rrt_ros_node
             double m_a; // maximum acceleration rate
             int m_i; // maximum number of iterations in optimization
             double e; // relative tolerance
-           
+            int p_t; // threads for the per piece duration optimization
+            int p_g; // pieces per duration optimization task
         };
 
         struct am_trajectory
         {
             std::pair<t_p_sc, t_p_sc> s_e_t; // start and end time of the trajectory
             Trajectory traj;
+            bool reused_path = false; // built on the path of an earlier search
         };
 
         struct orientation
@@ -113,15 +128,90 @@ class lro_rrt_ros_node
             EXEC_MISSION
         };
 
-        lro_rrt_server::lro_rrt_server_node rrt, map, sliding_map;
+        /** @brief Pose published by agent_forward_timer for the other timers **/
+        struct agent_pose
+        {
+            Eigen::Vector3d p;
+            Eigen::Quaterniond q;
+        };
+
+        struct mission_status
+        {
+            Eigen::Vector3d goal;
+            int state;
+            bool emergency_stop;
+            t_p_sc emergency_stop_time;
+            unsigned long id; // incremented with every new goal
+        };
+
+        lro_rrt_server::lro_rrt_server_node rrt;
+
+        /** 
+         * @brief Independent trees of the parallel search, rrt is tree 0
+         * Every tree has its own octree and random engine, the trees are grown
+         * on search_pool within the same runtime budget
+        **/
+        int search_trees;
+        vector<std::unique_ptr<lro_rrt_server::lro_rrt_server_node>> extra_trees;
+        std::unique_ptr<worker_pool> search_pool;
+        vector<vector<Eigen::Vector3d>> tree_paths;
+        vector<char> tree_success;
+
+        ring_buffer_map sliding_map;
         lro_rrt_server::parameters rrt_param;
         map_parameters m_p;
-        vector<Eigen::Vector3d> sensing_offset;
+        ray_table sensing_rays, world_rays; // body and world frame sensor rays
+        vector<int> packet_offset; // rays of packet i are [packet_offset[i], packet_offset[i+1])
+
+        // Global map, a new version is stored on every update
+        map_store map;
+
+        /** @brief Raycast workers and their own scratch and output buffers **/
+        std::unique_ptr<worker_pool> pool;
+        vector<sensor_map::packet_cache> packet_caches;
+        vector<vector<Eigen::Vector3d>> packet_hits;
+
+        typedef trajectory_timeline<am_trajectory> timeline;
+
+        /** @brief Everything a planning cycle reads, taken when the timer fires **/
+        struct planning_request
+        {
+            mission_status m;
+            t_p_sc timer, horizon_time;
+            std::shared_ptr<const timeline> am;
+            pcl::PointCloud<pcl::PointXYZ>::Ptr cloud;
+            map_view local_map; // at the planning resolution
+            Eigen::Vector3d point;
+        };
+
+        struct planning_result
+        {
+            planning_request r;
+            std::vector<Eigen::Vector3d> global_search_path;
+            int idx; // trajectory in r.am that is cut at the horizon time
+            bool reused_path; // global_search_path was not searched this cycle
+        };
 
         am_trajectory_parameters a_m_p; // am trajectory parameters
-        std::vector<am_trajectory> am;
 
-        std::mutex pose_update_mutex;
+        /** 
+         * @brief State shared between the timers
+         * The pose is only written by agent_forward_timer and read without
+         * locks. The mission and the trajectory timeline only change together
+         * under commit_mutex: a new goal, the transitions to IDLE (which also
+         * release the timeline) and the commits of the planning stages.
+         * The timeline is read without locks
+        **/
+        seqlock_snapshot<agent_pose> pose;
+        std::mutex commit_mutex;
+        mission_status mission; // guarded by commit_mutex
+        shared_snapshot<timeline> trajectories; // stored under commit_mutex
+
+        mission_status get_mission()
+        {
+            std::lock_guard<std::mutex> commit_lock(commit_mutex);
+            return mission;
+        }
 
         ros::NodeHandle _nh;
 
@@ -129,25 +219,46 @@ class lro_rrt_ros_node
         ros::Publisher local_pcl_pub, g_rrt_points_pub;
         ros::Publisher pose_pub, debug_pcl_pub, debug_position_pub;
         
-        pcl::PointCloud<pcl::PointXYZ>::Ptr full_cloud, local_cloud; 
-
-        Eigen::Vector3d current_point, goal;
+        map_store local_map;
+        // Points of local_cloud_map, built by get_local_cloud. The pointers are
+        // swapped under local_cloud_mutex, the cloud is never modified
+        pcl::PointCloud<pcl::PointXYZ>::Ptr local_cloud; 
+        std::shared_ptr<const sensor_map> local_cloud_map;
+        std::mutex local_cloud_mutex;
+
+        // Committed trajectories are appended by the optimise stage, off when empty
+        std::string trajectory_file;
+        std::unique_ptr<trajectory_log::writer> trajectory_logger;
+
+        // Only used by local_map_timer, voxels that changed since its last tick
+        vector<Eigen::Vector3d> map_added, map_removed;
+
+        // Only used by the search stage
+        vector<double> check_times;
+        vector<Eigen::Vector3d> check_points;
+        sensor_map::packet_cache check_cache;
+        // Path of the last successful search and the mission it was found for,
+        // reused at most max_path_reuse times in a row before searching again
+        vector<Eigen::Vector3d> previous_path;
+        unsigned long previous_path_id;
+        int max_path_reuse, path_reuses;
+
+        // Only used by agent_forward_timer
+        Eigen::Vector3d current_point;
+        std::shared_ptr<const timeline> agent_timeline;
+        size_t agent_cursor;
 
         vector<Eigen::Vector4d> no_fly_zone;
 
         Eigen::Vector4d color;
 
         double simulation_hz, map_hz, duration_committed, default_knot_spacing;
-        int degree, state;
-        bool is_safe;
+        int degree;
+        std::atomic<bool> is_safe;
         orientation orientation;
 
         double safety_horizon, reserve_time, reached_threshold;
 
-        bool init_cloud = false, emergency_stop = false;
-
-        t_p_sc emergency_stop_time;
-
         /** @brief Callbacks, mainly for loading pcl and commands **/
         void command_callback(const geometry_msgs::PointConstPtr& msg);
         void pcl2_callback(const sensor_msgs::PointCloud2ConstPtr& msg);
@@ -155,6 +266,46 @@ class lro_rrt_ros_node
         /** @brief Timers for searching and agent movement **/
         ros::Timer search_timer, agent_timer, map_timer;
         void rrt_search_timer(const ros::TimerEvent &);
+
+        /** 
+         * @brief Planning pipeline, rrt_search_timer feeds the search stage
+         * (octree update, validity check, RRT search and discretisation) which
+         * feeds the optimise stage (trajectory generation and commit).
+         * Each stage has its own thread so the octree of the next cycle is
+         * updated while the trajectory of the current one is optimised
+        **/
+        bounded_queue<planning_request> search_queue;
+        bounded_queue<planning_result> optimise_queue;
+        std::thread search_thread, optimise_thread;
+        void search_stage();
+        void optimise_stage();
+
+        /**
+         * @brief Move a result searched from an older timeline onto base, so a
+         * search that overlapped with the previous commit is not wasted
+         * @return false if the result cannot start from base
+        **/
+        bool rebase_result(const std::shared_ptr<const timeline> &base, 
+            planning_result &result, sensor_map::packet_cache &cache);
+
+        /** @brief Append a committed trajectory to the log, only the optimise stage calls it **/
+        void log_trajectory(const am_trajectory &a)
+        {
+            trajectory_logger->append(
+                duration<double>(a.s_e_t.first.time_since_epoch()).count(),
+                duration<double>(a.s_e_t.second.time_since_epoch()).count(), a.traj);
+        }
+        bool plan_search(const planning_request &r, planning_result &result);
+
+        lro_rrt_server::lro_rrt_server_node &get_tree(int i)
+        {
+            return i == 0 ? rrt : *extra_trees[i - 1];
+        }
+
+        void update_trees(
+            const pcl::PointCloud<pcl::PointXYZ>::Ptr &cloud, 
+            const Eigen::Vector3d &start, const Eigen::Vector3d &goal);
+        bool search_trees_for_path(vector<Eigen::Vector3d> &path);
         void agent_forward_timer(const ros::TimerEvent &);
         void local_map_timer(const ros::TimerEvent &);
 
@@ -241,6 +392,8 @@ class lro_rrt_ros_node
             rrt_param.s_l_v.first = search_limit_vfov_list[0];
             rrt_param.s_l_v.second = search_limit_vfov_list[1];
             _nh.param<double>("planning/scaled_min_dist_from_node", rrt_param.s_d_n, -1.0);
+            _nh.param<int>("planning/parallel_trees", search_trees, 1);
+            _nh.param<int>("planning/max_path_reuse", max_path_reuse, 2);
             _nh.getParam("planning/height", height_list);
             rrt_param.h_c.first = height_list[0];
             rrt_param.h_c.second = height_list[1];
@@ -261,6 +414,7 @@ class lro_rrt_ros_node
             _nh.param<double>("map/size", rrt_param.m_s, -1.0);
             _nh.param<double>("map/vfov", m_p.vfov, -1.0);
             _nh.param<double>("map/hfov", m_p.hfov, -1.0);
+            _nh.param<int>("map/packet_size", m_p.p_s, 4);
 
             // _nh.param<int>("map/hpixel", m_p.h_p, -1);
             // _nh.param<int>("map/vpixel", m_p.v_p, -1);
@@ -270,6 +424,7 @@ class lro_rrt_ros_node
 
             _nh.param<double>("sliding_map/size", m_p.s_m_s, -1.0);
             _nh.param<double>("sliding_map/resolution", m_p.s_m_r, -1.0);
+            sliding_map.set_parameters(m_p.s_m_s, m_p.s_m_r);
 
             _nh.param<double>("amtraj/weight/time_regularization", a_m_p.w_t, -1.0);
             _nh.param<double>("amtraj/weight/acceleration", a_m_p.w_a, -1.0);
@@ -278,11 +433,15 @@ class lro_rrt_ros_node
             _nh.param<double>("amtraj/limits/max_acc", a_m_p.m_a, -1.0);
             _nh.param<int>("amtraj/limits/iterations", a_m_p.m_i, -1);
             _nh.param<double>("amtraj/limits/epsilon", a_m_p.e, -1.0);
+            _nh.param<int>("amtraj/parallel/threads", a_m_p.p_t, 1);
+            _nh.param<int>("amtraj/parallel/grain", a_m_p.p_g, 16);
 
             _nh.param<double>("safety/total_safety_horizon", safety_horizon, -1.0);
             _nh.param<double>("safety/reserve_time", reserve_time, -1.0);
             _nh.param<double>("safety/reached_threshold", reached_threshold, -1.0);
 
+            _nh.param<std::string>("logging/trajectory_file", trajectory_file, "");
+
             pcl2_msg_sub = _nh.subscribe<sensor_msgs::PointCloud2>(
                 "/mock_map", 1,  boost::bind(&lro_rrt_ros_node::pcl2_callback, this, _1));
             command_sub = _nh.subscribe<geometry_msgs::Point>(
@@ -328,6 +487,13 @@ class lro_rrt_ros_node
 
             // Let us start at the random start point
             current_point = start;
+            agent_cursor = 0;
+            previous_path_id = 0;
+            path_reuses = 0;
+            orientation.e = Eigen::Vector3d::Zero();
+            orientation.q = Eigen::Quaterniond::Identity();
+            orientation.r = Eigen::Matrix3d::Identity();
+            pose.store(agent_pose{current_point, orientation.q});
 
             m_p.v_d = 2.0 * rrt_param.s_r * tan(m_p.vfov/2.0);
             m_p.h_d = 2.0 * rrt_param.s_r * sin(m_p.hfov/2.0);
@@ -335,21 +501,45 @@ class lro_rrt_ros_node
             m_p.v_s = m_p.vfov / (double)m_p.v_p;
             m_p.h_s = m_p.hfov / (double)m_p.h_p;
 
-            for (int i = 0; i < m_p.v_p; i++)
-                for (int j = 0; j < m_p.h_p; j++)
-                {
-                    Eigen::Vector3d q = Eigen::Vector3d(
-                        rrt_param.s_r * cos(j*m_p.h_s - m_p.hfov/2.0),
-                        rrt_param.s_r * sin(j*m_p.h_s - m_p.hfov/2.0),
-                        rrt_param.s_r * tan(i*m_p.v_s - m_p.vfov/2.0)
-                    );
-                    sensing_offset.push_back(q);
-                }
+            // Rays are stored tile by tile so that each packet is contiguous
+            m_p.p_s = max(m_p.p_s, 1);
+            sensing_rays.set_fov(m_p.vfov, m_p.hfov, m_p.v_p, m_p.h_p, 
+                rrt_param.s_r, m_p.p_s, packet_offset);
             
             local_cloud = pcl::PointCloud<pcl::PointXYZ>::Ptr(
                 new pcl::PointCloud<pcl::PointXYZ>());
+            std::shared_ptr<sensor_map> empty_map = std::make_shared<sensor_map>();
+            empty_map->set_resolution(m_p.s_m_r);
+            local_map.store(empty_map);
+
+            if (!trajectory_file.empty())
+            {
+                trajectory_logger.reset(new trajectory_log::writer(trajectory_file));
+                if (!trajectory_logger->is_open())
+                {
+                    std::cout << KRED << "unable to open " << trajectory_file << KNRM << std::endl;
+                    trajectory_logger.reset();
+                }
+            }
+
+            search_trees = max(search_trees, 1);
+            for (int i = 1; i < search_trees; i++)
+                extra_trees.emplace_back(new lro_rrt_server::lro_rrt_server_node());
+            search_pool.reset(new worker_pool(search_trees));
+            tree_paths.resize(search_trees);
+            tree_success.resize(search_trees);
+
+            pool.reset(new worker_pool(threads));
+            packet_caches.resize(pool->size());
+            packet_hits.resize(pool->size());
 
-            state = agent_state::IDLE;
+            mission.goal = current_point;
+            mission.state = agent_state::IDLE;
+            mission.emergency_stop = false;
+            mission.id = 0;
+
+            search_thread = std::thread(&lro_rrt_ros_node::search_stage, this);
+            optimise_thread = std::thread(&lro_rrt_ros_node::optimise_stage, this);
 
             agent_timer.start();
             search_timer.start();
@@ -359,61 +549,193 @@ class lro_rrt_ros_node
         ~lro_rrt_ros_node()
         {
             // Clear all the points within the clouds
-            full_cloud->points.clear();
             local_cloud->points.clear();
 
             // Stop all the timers
             agent_timer.stop();
             search_timer.stop();
             map_timer.stop();
+
+            // Release and join the planning stages
+            search_queue.close();
+            optimise_queue.close();
+            search_thread.join();
+            optimise_thread.join();
         }
 
-        /** @brief Convert point cloud from ROS sensor message to pcl point ptr **/
-        pcl::PointCloud<pcl::PointXYZ>::Ptr 
-            pcl2_converter(sensor_msgs::PointCloud2 _pc)
+        /** 
+         * @brief Insert the points of a ROS sensor message into the sensor map
+         * The x, y and z fields are read in place through strided iterators
+         * over the message buffer, nothing is copied into an intermediate cloud
+        **/
+        void pcl2_to_sensor_map(
+            const sensor_msgs::PointCloud2 &_pc, sensor_map &s_map)
         {
-            pcl::PCLPointCloud2 pcl_pc2;
-            pcl_conversions::toPCL(_pc, pcl_pc2);
+            sensor_msgs::PointCloud2ConstIterator<float> x(_pc, "x");
+            sensor_msgs::PointCloud2ConstIterator<float> y(_pc, "y");
+            sensor_msgs::PointCloud2ConstIterator<float> z(_pc, "z");
 
-            pcl::PointCloud<pcl::PointXYZ>::Ptr tmp_cloud(new pcl::PointCloud<pcl::PointXYZ>);
-            
-            pcl::fromPCLPointCloud2(pcl_pc2, *tmp_cloud);
-            
-            return tmp_cloud;
+            for (; x != x.end(); ++x, ++y, ++z)
+            {
+                // Clouds that are not dense carry NaN for invalid points
+                if (!std::isfinite(*x) || !std::isfinite(*y) || !std::isfinite(*z))
+                    continue;
+                s_map.insert(Eigen::Vector3d(*x, *y, *z));
+            }
         }
         
          
+        /** @brief Called without pose_update_mutex, the pose and map are passed in **/
         pcl::PointCloud<pcl::PointXYZ>::Ptr 
-            raycast_pcl_w_fov(Eigen::Vector3d p)
+            raycast_pcl_w_fov(Eigen::Vector3d p, Eigen::Quaterniond q,
+            const sensor_map &s_map)
         {
             pcl::PointCloud<pcl::PointXYZ>::Ptr tmp(new pcl::PointCloud<pcl::PointXYZ>);
 
-            for (int i = 0; i < (int)sensing_offset.size(); i++)
+            // One rotation matrix for the whole ray table
+            sensing_rays.rotate(q.toRotationMatrix().cast<float>(), world_rays);
+
+            // Each packet of neighbouring rays walks the map once,
+            // packets are shared out to the workers which keep their own hits
+            for (vector<Eigen::Vector3d> &hits : packet_hits)
+                hits.clear();
+            pool->parallel_for((int)packet_offset.size() - 1, 4,
+                [&](int begin, int end, int worker)
+                {
+                    for (int i = begin; i < end; i++)
+                        s_map.cast_packet(p, world_rays, packet_offset[i],
+                            packet_offset[i+1], packet_caches[worker], packet_hits[worker]);
+                });
+
+            // Merge the per worker buffers into disjoint ranges of the cloud
+            vector<int> hits_offset(packet_hits.size() + 1, 0);
+            for (int i = 0; i < (int)packet_hits.size(); i++)
+                hits_offset[i+1] = hits_offset[i] + (int)packet_hits[i].size();
+            tmp->points.resize(hits_offset.back());
+            pool->parallel_for((int)packet_hits.size(), 1,
+                [&](int begin, int end, int)
+                {
+                    for (int i = begin; i < end; i++)
+                        for (int j = 0; j < (int)packet_hits[i].size(); j++)
+                        {
+                            pcl::PointXYZ &add = tmp->points[hits_offset[i] + j];
+                            add.x = packet_hits[i][j].x();
+                            add.y = packet_hits[i][j].y();
+                            add.z = packet_hits[i][j].z();
+                        }
+                });
+            tmp->width = tmp->points.size();
+            tmp->height = 1;
+
+            return tmp;
+
+        }
+
+        /**
+         * @brief Cloud of the voxel centers of a local map version
+         * The cloud is only built when a planning cycle or a subscriber asks
+         * for it, and is kept until the map changes
+        **/
+        pcl::PointCloud<pcl::PointXYZ>::Ptr get_local_cloud(
+            const std::shared_ptr<const sensor_map> &s_map)
+        {
+            std::lock_guard<std::mutex> cloud_lock(local_cloud_mutex);
+            if (s_map == local_cloud_map)
+                return local_cloud;
+
+            pcl::PointCloud<pcl::PointXYZ>::Ptr tmp(new pcl::PointCloud<pcl::PointXYZ>);
+            s_map->for_each_occupied([&tmp](const Eigen::Vector3d &p)
+            {
+                tmp->points.push_back(pcl::PointXYZ(p.x(), p.y(), p.z()));
+            });
+            tmp->width = tmp->points.size();
+            tmp->height = 1;
+
+            local_cloud = tmp;
+            local_cloud_map = s_map;
+            return tmp;
+        }
+
+        /**
+         * @brief First time in [t_b, t_e] at which traj comes within radius of
+         * an occupied voxel of s_map, -1 if it never does
+         * Each piece is sampled with a step of half a voxel over the bound on
+         * its speed, so consecutive samples are at most half a voxel apart
+         * and slow pieces take fewer samples. The segments between samples are
+         * checked together against the bricks around the piece, pieces are
+         * checked in order and the check stops at the first blocked segment
+        **/
+        double get_collision_time(const Trajectory &traj, double t_b, double t_e,
+            const map_view &s_map, double radius)
+        {
+            if (s_map.empty())
+                return -1.0;
+
+            double step = s_map.get_resolution() / 2.0;
+            double offset = 0.0;
+            for (int i = 0; i < traj.getPieceNum() && offset <= t_e; i++)
             {
-                Eigen::Quaterniond point;
-                point.w() = 0;
-                point.vec() = sensing_offset[i];
-                Eigen::Quaterniond rotatedP = orientation.q * point * orientation.q.inverse(); 
-                Eigen::Vector3d q = p + rotatedP.vec();
-
-                Eigen::Vector3d intersect;
-                // Eigen::Vector3d q = p + sensing_offset[i];
-                if (!map.check_approx_intersection_by_segment(
-                    p, q, intersect))
+                const Piece &piece = traj[i];
+                double d = piece.getDuration();
+                // The last piece also takes everything after it
+                double begin = max(offset, t_b);
+                double end = i == traj.getPieceNum() - 1 ? t_e : min(offset + d, t_e);
+                offset += d;
+                if (end < begin)
+                    continue;
+
+                // |v| is bounded by the sum of the normalized coefficient norms
+                double v_max = piece.getVelCoeffMat(true).colwise().norm().sum() / d;
+                int n = max((int)ceil((end - begin) * v_max / step), 1);
+
+                check_times.resize(n + 1);
+                check_points.resize(n + 1);
+                for (int j = 0; j <= n; j++)
+                    check_times[j] = begin + (end - begin) * j / n;
+                piece.getPos(check_times.data(), n + 1, offset - d, check_points.data());
+
+                int j = s_map.get_first_blocked_segment(
+                    check_points.data(), n + 1, radius, check_cache);
+                if (j >= 0)
+                    return check_times[j];
+            }
+
+            return -1.0;
+        }
+
+        /**
+         * @brief Reuse the path of the previous search from a new start
+         * The path is re-rooted at start, which is joined to the end of the
+         * segment closest to it, and only used while every edge is still clear
+         * @return false if there is no path for this mission or it is blocked
+        **/
+        bool reroot_previous_path(unsigned long id, const Eigen::Vector3d &start,
+            const map_view &s_map, double radius, vector<Eigen::Vector3d> &path)
+        {
+            if (previous_path.size() < 2 || previous_path_id != id)
+                return false;
+
+            size_t closest = 0;
+            double closest_dist = INFINITY;
+            for (size_t j = 0; j + 1 < previous_path.size(); j++)
+            {
+                Eigen::Vector3d a = previous_path[j], ab = previous_path[j+1] - a;
+                double s = ab.squaredNorm() > 0.0 ? 
+                    std::min(std::max((start - a).dot(ab) / ab.squaredNorm(), 0.0), 1.0) : 0.0;
+                double dist = (a + s * ab - start).norm();
+                if (dist < closest_dist)
                 {
-                    Eigen::Vector3d direction = (q - p).normalized(); 
-                    // intersect += m_p.s_m_r/2 * direction;
-                    pcl::PointXYZ add;
-                    add.x = intersect.x();
-                    add.y = intersect.y();
-                    add.z = intersect.z();
-                    tmp->points.push_back(add);
+                    closest = j;
+                    closest_dist = dist;
                 }
-
             }
 
-            return tmp;
+            path.clear();
+            path.push_back(start);
+            path.insert(path.end(), previous_path.begin() + closest + 1, previous_path.end());
 
+            return s_map.empty() || s_map.get_first_blocked_segment(
+                path.data(), (int)path.size(), radius, check_cache) < 0;
         }
 
         // pcl::PointCloud<pcl::PointXYZ>::Ptr update_occupancy_buffer(
@@ -0,0 +1,174 @@
+/*
+* map_store.h
+*
+* ---------------------------------------------------------------------
+* Copyright (C) 2022 Matthew (matthewoots at gmail.com)
+*
+*  This program is free software; you can redistribute it and/or
+*  modify it under the terms of the GNU General Public License
+*  as published by the Free Software Foundation; either version 2
+*  of the License, or (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+* ---------------------------------------------------------------------
+*/
+#ifndef MAP_STORE_H
+#define MAP_STORE_H
+
+#include "sensor_map.h"
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <Eigen/Dense>
+
+/**
+ * @brief Read only handle on one version of a map at a coarser resolution
+ * The resolution is an integer multiple (scale) of the map resolution, a view
+ * voxel is occupied when any map voxel inside it is. The view keeps its
+ * version alive, copying it only copies the pointer
+**/
+class map_view
+{
+    public:
+
+        map_view() : scale(1) {}
+
+        map_view(std::shared_ptr<const sensor_map> m, int s) :
+            source(std::move(m)), scale(std::max(s, 1)) {}
+
+        bool empty() const { return !source || source->empty(); }
+
+        double get_resolution() const { return source->get_resolution() * scale; }
+
+        bool is_occupied(const Eigen::Vector3d &p) const
+        {
+            if (scale == 1)
+                return source->is_occupied(p);
+            return test_voxel(get_voxel(p));
+        }
+
+        /** @brief Whether the center of an occupied view voxel lies within radius of p **/
+        bool is_occupied_within(const Eigen::Vector3d &p, double radius) const
+        {
+            if (scale == 1)
+                return source->is_occupied_within(p, radius);
+
+            double resolution = get_resolution();
+            Eigen::Vector3i c = get_voxel(p);
+            int n = (int)std::ceil(radius / resolution);
+            double r_sq = radius * radius;
+            for (int x = -n; x <= n; x++)
+                for (int y = -n; y <= n; y++)
+                    for (int z = -n; z <= n; z++)
+                    {
+                        Eigen::Vector3i v = c + Eigen::Vector3i(x, y, z);
+                        Eigen::Vector3d center = (v.cast<double>() +
+                            Eigen::Vector3d::Constant(0.5)) * resolution;
+                        if ((center - p).squaredNorm() <= r_sq && test_voxel(v))
+                            return true;
+                    }
+            return false;
+        }
+
+        /**
+         * @brief First segment path[i] -> path[i+1] that passes within radius
+         * of an occupied view voxel, -1 if all are clear
+        **/
+        int get_first_blocked_segment(
+            const Eigen::Vector3d *path, int n_points, double radius,
+            sensor_map::packet_cache &cache) const
+        {
+            if (scale == 1)
+                return source->get_first_blocked_segment(path, n_points, radius, cache);
+
+            // Coarse views are sampled at half of their resolution
+            double step = get_resolution() / 2.0;
+            for (int i = 0; i + 1 < n_points; i++)
+            {
+                Eigen::Vector3d d = path[i+1] - path[i];
+                int m = std::max((int)std::ceil(d.norm() / step), 1);
+                for (int j = 0; j <= m; j++)
+                    if (is_occupied_within(path[i] + d * ((double)j / m), radius))
+                        return i;
+            }
+            return -1;
+        }
+
+    private:
+
+        std::shared_ptr<const sensor_map> source;
+        int scale;
+
+        inline Eigen::Vector3i get_voxel(const Eigen::Vector3d &p) const
+        {
+            Eigen::Vector3d q = p / get_resolution();
+            return Eigen::Vector3i(
+                (int)std::floor(q.x()), (int)std::floor(q.y()), (int)std::floor(q.z()));
+        }
+
+        inline bool test_voxel(const Eigen::Vector3i &v) const
+        {
+            return source->is_occupied_box(v * scale, v * scale +
+                Eigen::Vector3i::Constant(scale - 1));
+        }
+};
+
+/**
+ * @brief Latest version of a map, shared by everyone that reads it
+ * Writers build the next version from a copy of the current one, which shares
+ * all the bricks that they do not touch, and swap it in with std::atomic_store.
+ * Readers hold a version through a shared pointer or a map_view, so nothing
+ * is copied and nobody waits on an update
+**/
+class map_store
+{
+    public:
+
+        map_store() {}
+
+        map_store(const map_store &) = delete;
+        map_store &operator=(const map_store &) = delete;
+
+        /** @brief Current version, nullptr until the first one is stored **/
+        std::shared_ptr<const sensor_map> load() const
+        {
+            return std::atomic_load(&current);
+        }
+
+        void store(std::shared_ptr<const sensor_map> m)
+        {
+            std::atomic_store(&current, std::move(m));
+        }
+
+        /** @brief Copy of the current version to build the next one from **/
+        std::shared_ptr<sensor_map> edit() const
+        {
+            std::shared_ptr<const sensor_map> m = load();
+            return m ? std::make_shared<sensor_map>(*m) : std::make_shared<sensor_map>();
+        }
+
+        /**
+         * @brief View of version m at the coarsest multiple of its resolution
+         * that does not exceed resolution
+         * A coarser view is only used when resolution is at least twice the
+         * map resolution. With sample.launch the planning resolution (0.35)
+         * is finer than the local map (0.5), so the map itself is checked
+        **/
+        static map_view view(std::shared_ptr<const sensor_map> m, double resolution)
+        {
+            if (!m)
+                return map_view();
+            int s = (int)std::floor(resolution / m->get_resolution() + 1e-6);
+            return map_view(std::move(m), s);
+        }
+
+    private:
+
+        std::shared_ptr<const sensor_map> current;
+};
+
+#endif
@@ -0,0 +1,52 @@
+/*
+* path_selection.h
+*
+* ---------------------------------------------------------------------
+* Copyright (C) 2022 Matthew (matthewoots at gmail.com)
+*
+*  This program is free software; you can redistribute it and/or
+*  modify it under the terms of the GNU General Public License
+*  as published by the Free Software Foundation; either version 2
+*  of the License, or (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+* ---------------------------------------------------------------------
+*/
+#ifndef PATH_SELECTION_H
+#define PATH_SELECTION_H
+
+#include <cmath>
+#include <vector>
+#include <Eigen/Dense>
+
+/**
+ * @brief Index of the path to keep out of the paths of parallel trees
+ * The shortest successful path wins, the lowest index on a tie. If no tree
+ * succeeded it is 0, the safe path of tree 0 is used like with a single tree
+**/
+inline int select_shortest_path(
+    const std::vector<std::vector<Eigen::Vector3d>> &paths,
+    const std::vector<char> &success)
+{
+    int best = 0;
+    double best_length = INFINITY;
+    for (int i = 0; i < (int)paths.size(); i++)
+    {
+        if (!success[i])
+            continue;
+        double length = 0.0;
+        for (size_t j = 1; j < paths[i].size(); j++)
+            length += (paths[i][j] - paths[i][j-1]).norm();
+        if (length < best_length)
+        {
+            best = i;
+            best_length = length;
+        }
+    }
+    return best;
+}
+
+#endif
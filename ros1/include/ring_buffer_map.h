@@ -0,0 +1,246 @@
+/*
+* ring_buffer_map.h
+*
+* ---------------------------------------------------------------------
+* Copyright (C) 2022 Matthew (matthewoots at gmail.com)
+*
+*  This program is free software; you can redistribute it and/or
+*  modify it under the terms of the GNU General Public License
+*  as published by the Free Software Foundation; either version 2
+*  of the License, or (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+* ---------------------------------------------------------------------
+*/
+#ifndef RING_BUFFER_MAP_H
+#define RING_BUFFER_MAP_H
+
+#include <cmath>
+#include <vector>
+#include <Eigen/Dense>
+
+/**
+ * @brief Fixed size voxel grid that rolls with the agent
+ * The window holds n x n x n voxels, a voxel with global index v lives in cell
+ * (v mod n), so moving the window only clears the slabs that leave it.
+ * Occupied cells are also kept in a list so that reading them out does not
+ * scan the whole grid, and the voxels that changed are kept until they are
+ * taken so that copies of the map can be updated incrementally
+**/
+class ring_buffer_map
+{
+    public:
+
+        ring_buffer_map() : n(0), resolution(1.0) {}
+
+        /** @brief size is the edge length of the window **/
+        void set_parameters(double size, double res)
+        {
+            resolution = res;
+            n = std::max((int)std::ceil(size / res), 1);
+            slot.assign(n * n * n, -1);
+            change_slot.assign(n * n * n, -1);
+            occupied.clear();
+            changes.clear();
+            origin = Eigen::Vector3i::Zero();
+        }
+
+        bool initialized() const { return n > 0; }
+
+        double get_resolution() const { return resolution; }
+
+        int size() const { return (int)occupied.size(); }
+
+        /** @brief Center the window on p, slabs that leave the window are recycled **/
+        void move_to(const Eigen::Vector3d &p)
+        {
+            Eigen::Vector3i new_origin = get_voxel(p) - Eigen::Vector3i::Constant(n / 2);
+
+            for (int k = 0; k < 3; k++)
+            {
+                int d = new_origin(k) - origin(k);
+                if (d == 0)
+                    continue;
+
+                // Every slab leaves the window
+                if (std::abs(d) >= n)
+                {
+                    clear();
+                    origin = new_origin;
+                    return;
+                }
+
+                int first = d > 0 ? origin(k) : origin(k) + n + d;
+                for (int i = first; i < first + std::abs(d); i++)
+                    clear_slab(k, wrap(i));
+                origin(k) = new_origin(k);
+            }
+        }
+
+        /** @brief Mark the voxel of p as occupied, points outside the window are ignored **/
+        bool insert(const Eigen::Vector3d &p)
+        {
+            Eigen::Vector3i v = get_voxel(p);
+            if (!is_inside(v))
+                return false;
+
+            int c = get_cell(v);
+            if (slot[c] >= 0)
+                return false;
+
+            slot[c] = (int)occupied.size();
+            occupied.push_back(c);
+
+            // Freed and occupied again since the changes were last taken
+            int s = change_slot[c];
+            if (s >= 0 && changes[s].state == change::removed && changes[s].voxel == v)
+                changes[s].state = change::cancelled;
+            else
+                record(v, c, change::added);
+            return true;
+        }
+
+        bool is_occupied(const Eigen::Vector3d &p) const
+        {
+            Eigen::Vector3i v = get_voxel(p);
+            return is_inside(v) && slot[get_cell(v)] >= 0;
+        }
+
+        void clear()
+        {
+            while (!occupied.empty())
+                erase(occupied.back());
+        }
+
+        /** @brief Voxel center of the i-th occupied cell, 0 <= i < size() **/
+        Eigen::Vector3d get_point(int i) const
+        {
+            return get_center(get_cell_voxel(occupied[i]));
+        }
+
+        /**
+         * @brief Voxel centers that became occupied and free since the last call
+         * A voxel that went back to its old state in between is not reported,
+         * apply removed before added to bring a copy of the map up to date
+        **/
+        void take_changes(
+            std::vector<Eigen::Vector3d> &added, std::vector<Eigen::Vector3d> &removed)
+        {
+            added.clear();
+            removed.clear();
+            for (const change &ch : changes)
+            {
+                if (ch.state == change::added)
+                    added.push_back(get_center(ch.voxel));
+                else if (ch.state == change::removed)
+                    removed.push_back(get_center(ch.voxel));
+                change_slot[ch.cell] = -1;
+            }
+            changes.clear();
+        }
+
+    private:
+
+        int n;
+        double resolution;
+        Eigen::Vector3i origin; // global index of the minimum corner of the window
+
+        std::vector<int> slot; // position of the cell in occupied, -1 when free
+        std::vector<int> occupied;
+
+        struct change
+        {
+            enum { added, removed, cancelled } state;
+            Eigen::Vector3i voxel;
+            int cell;
+        };
+        std::vector<change> changes; // since the last take_changes
+        std::vector<int> change_slot; // latest change of the cell, -1 when none
+
+        inline void record(const Eigen::Vector3i &v, int c, decltype(change::state) state)
+        {
+            change_slot[c] = (int)changes.size();
+            changes.push_back(change{state, v, c});
+        }
+
+        inline Eigen::Vector3i get_voxel(const Eigen::Vector3d &p) const
+        {
+            return Eigen::Vector3i(
+                (int)std::floor(p.x() / resolution),
+                (int)std::floor(p.y() / resolution),
+                (int)std::floor(p.z() / resolution));
+        }
+
+        inline int wrap(int i) const
+        {
+            int w = i % n;
+            return w < 0 ? w + n : w;
+        }
+
+        inline bool is_inside(const Eigen::Vector3i &v) const
+        {
+            return (v.array() >= origin.array()).all() &&
+                (v.array() < origin.array() + n).all();
+        }
+
+        inline int get_cell(const Eigen::Vector3i &v) const
+        {
+            return wrap(v.x()) + n * (wrap(v.y()) + n * wrap(v.z()));
+        }
+
+        // Global index of the voxel that cell c holds in the current window
+        inline Eigen::Vector3i get_cell_voxel(int c) const
+        {
+            Eigen::Vector3i w(c % n, (c / n) % n, c / (n * n));
+            Eigen::Vector3i v;
+            for (int k = 0; k < 3; k++)
+                v(k) = origin(k) + wrap(w(k) - wrap(origin(k)));
+            return v;
+        }
+
+        inline Eigen::Vector3d get_center(const Eigen::Vector3i &v) const
+        {
+            return (v.cast<double>() + Eigen::Vector3d::Constant(0.5)) * resolution;
+        }
+
+        inline void erase(int c)
+        {
+            int s = slot[c];
+            if (s < 0)
+                return;
+            int last = occupied.back();
+            occupied[s] = last;
+            slot[last] = s;
+            occupied.pop_back();
+            slot[c] = -1;
+
+            // Occupied and freed again since the changes were last taken
+            int t = change_slot[c];
+            if (t >= 0 && changes[t].state == change::added)
+            {
+                changes[t].state = change::cancelled;
+                change_slot[c] = -1;
+            }
+            else
+                record(get_cell_voxel(c), c, change::removed);
+        }
+
+        // Free every cell whose wrapped index along axis k is w
+        void clear_slab(int k, int w)
+        {
+            for (int a = 0; a < n; a++)
+                for (int b = 0; b < n; b++)
+                {
+                    Eigen::Vector3i cell;
+                    cell(k) = w;
+                    cell((k + 1) % 3) = a;
+                    cell((k + 2) % 3) = b;
+                    erase(cell.x() + n * (cell.y() + n * cell.z()));
+                }
+        }
+};
+
+#endif
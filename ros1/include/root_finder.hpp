@@ -12,6 +12,100 @@ namespace RootFinderParam
 constexpr size_t highestOrder = 64;
 }
 
+namespace RootFinder
+{
+
+class RootSet
+// Sorted distinct roots with a fixed capacity, a drop-in for the std::set<double>
+// the solvers used to return, so that root queries never allocate.
+// Besides all roots of a highestOrder polynomial there is room for the
+// few candidates callers add, values beyond the capacity are dropped
+{
+public:
+    static constexpr int capacity = RootFinderParam::highestOrder + 8;
+
+    RootSet() : num(0) {}
+
+    inline void insert(double x)
+    {
+        int i = num;
+        while (i > 0 && x < vals[i - 1])
+        {
+            i--;
+        }
+        if ((i > 0 && vals[i - 1] == x) || num == capacity)
+        {
+            return;
+        }
+        for (int j = num; j > i; j--)
+        {
+            vals[j] = vals[j - 1];
+        }
+        vals[i] = x;
+        num++;
+    }
+
+    // Keep only the roots inside the open interval (lbound, ubound)
+    inline void keepWithin(double lbound, double ubound)
+    {
+        int k = 0;
+        for (int i = 0; i < num; i++)
+        {
+            if (vals[i] > lbound && vals[i] < ubound)
+            {
+                vals[k++] = vals[i];
+            }
+        }
+        num = k;
+    }
+
+    inline void clear()
+    {
+        num = 0;
+    }
+
+    inline int size() const
+    {
+        return num;
+    }
+
+    inline bool empty() const
+    {
+        return num == 0;
+    }
+
+    inline double front() const
+    {
+        return vals[0];
+    }
+
+    inline double back() const
+    {
+        return vals[num - 1];
+    }
+
+    inline const double *begin() const
+    {
+        return vals;
+    }
+
+    inline const double *end() const
+    {
+        return vals + num;
+    }
+
+    inline std::set<double> toSet() const
+    {
+        return std::set<double>(begin(), end());
+    }
+
+private:
+    int num;
+    double vals[capacity];
+};
+
+} // namespace RootFinder
+
 namespace RootFinderPriv
 {
 
@@ -99,11 +193,9 @@ inline double polyEval(double *p, int len, double x)
     return retVal;
 }
 
-inline std::set<double> solveCub(double a, double b, double c, double d)
-// Calculate all roots of a*x^3 + b*x^2 + c*x + d = 0
+inline void solveCub(double a, double b, double c, double d, RootFinder::RootSet &roots)
+// Calculate all roots of a*x^3 + b*x^2 + c*x + d = 0 and add them to roots
 {
-    std::set<double> roots;
-
     constexpr double cos120 = -0.50;
     constexpr double sin120 = 0.866025403784438646764;
 
@@ -206,7 +298,14 @@ inline std::set<double> solveCub(double a, double b, double c, double d)
             roots.insert(2.0 * w * cos120 - bover3a);
         }
     }
-    return roots;
+}
+
+inline std::set<double> solveCub(double a, double b, double c, double d)
+// Calculate all roots of a*x^3 + b*x^2 + c*x + d = 0
+{
+    RootFinder::RootSet roots;
+    solveCub(a, b, c, d, roots);
+    return roots.toSet();
 }
 
 inline int solveResolvent(double *x, double a, double b, double c)
@@ -262,12 +361,10 @@ inline int solveResolvent(double *x, double a, double b, double c)
     }
 }
 
-inline std::set<double> solveQuartMonic(double a, double b, double c, double d)
-// Calculate all roots of the monic quartic equation:
+inline void solveQuartMonic(double a, double b, double c, double d, RootFinder::RootSet &roots)
+// Calculate all roots of the monic quartic equation and add them to roots:
 // x^4 + a*x^3 + b*x^2 + c*x +d = 0
 {
-    std::set<double> roots;
-
     double a3 = -b;
     double b3 = a * c - 4.0 * d;
     double c3 = -a * a * d - c * c + 4.0 * b * d;
@@ -346,24 +443,40 @@ inline std::set<double> solveQuartMonic(double a, double b, double c, double d)
         roots.insert((-p2 + sqrtD) * 0.5);
         roots.insert((-p2 - sqrtD) * 0.5);
     }
+}
 
-    return roots;
+inline std::set<double> solveQuartMonic(double a, double b, double c, double d)
+// Calculate all roots of the monic quartic equation:
+// x^4 + a*x^3 + b*x^2 + c*x +d = 0
+{
+    RootFinder::RootSet roots;
+    solveQuartMonic(a, b, c, d, roots);
+    return roots.toSet();
 }
 
-inline std::set<double> solveQuart(double a, double b, double c, double d, double e)
+inline void solveQuart(double a, double b, double c, double d, double e, RootFinder::RootSet &roots)
 // Calculate the quartic equation: a*x^4 + b*x^3 + c*x^2 + d*x + e = 0
-// All coefficients can be zero
+// and add its roots to roots. All coefficients can be zero
 {
     if (fabs(a) < DBL_EPSILON)
     {
-        return solveCub(b, c, d, e);
+        solveCub(b, c, d, e, roots);
     }
     else
     {
-        return solveQuartMonic(b / a, c / a, d / a, e / a);
+        solveQuartMonic(b / a, c / a, d / a, e / a, roots);
     }
 }
 
+inline std::set<double> solveQuart(double a, double b, double c, double d, double e)
+// Calculate the quartic equation: a*x^4 + b*x^3 + c*x^2 + d*x + e = 0
+// All coefficients can be zero
+{
+    RootFinder::RootSet roots;
+    solveQuart(a, b, c, d, e, roots);
+    return roots.toSet();
+}
+
 inline std::set<double> eigenSolveRealRoots(const Eigen::VectorXd &coeffs, double lbound, double ubound, double tol)
 // Calculate roots of coeffs(x) inside (lbound, rbound) by computing eigen values of its companion matrix
 // Complex roots with magnitude of imaginary part less than tol are considered real
@@ -510,19 +623,18 @@ inline double shrinkInterval(double *coeffs, int numCoeffs, double lbound, doubl
 // Calculate a single zero of poly coeffs(x) inside [lbound, ubound]
 // Requirements: coeffs(lbound)*coeffs(ubound) < 0, lbound < ubound
 {
-    double *dcoeffs = new double[numCoeffs - 1];
+    double dcoeffs[RootFinderParam::highestOrder];
     polyDeri(coeffs, dcoeffs, numCoeffs);
     auto func = [&coeffs, &numCoeffs](double x) { return polyEval(coeffs, numCoeffs, x); };
     auto dfunc = [&dcoeffs, &numCoeffs](double x) { return polyEval(dcoeffs, numCoeffs - 1, x); };
     constexpr int maxDblIts = 128;
     double rts = safeNewton(func, dfunc, lbound, ubound, tol, maxDblIts);
-    delete[] dcoeffs;
     return rts;
 }
 
 inline void recurIsolate(double l, double r, double fl, double fr, int lnv, int rnv,
                          double tol, double **sturmSeqs, int *szSeq, int len,
-                         std::set<double> &rts)
+                         RootFinder::RootSet &rts)
 // Isolate all roots of sturmSeqs[0](x) inside interval (l, r) recursively and store them in rts
 // Requirements: fl := sturmSeqs[0](l) != 0, fr := sturmSeqs[0](r) != 0, l < r,
 //               lnv != rnv, lnv = numSignVar(l), rnv = numSignVar(r)
@@ -643,38 +755,50 @@ inline void recurIsolate(double l, double r, double fl, double fr, int lnv, int
     }
 };
 
-inline std::set<double> isolateRealRoots(const Eigen::VectorXd &coeffs, double lbound, double ubound, double tol)
-// Calculate roots of coeffs(x) inside (lbound, rbound) leveraging Sturm theory
+inline void isolateRealRoots(const Eigen::Ref<const Eigen::VectorXd> &coeffs, double lbound, double ubound, double tol,
+                             RootFinder::RootSet &rts)
+// Calculate roots of coeffs(x) inside (lbound, rbound) leveraging Sturm theory and add them to rts
+// All scratch memory lives on the stack
 // Requirement: leading coefficient must be nonzero
 //              coeffs(lbound) != 0, coeffs(rbound) != 0, lbound < rbound
 {
-    std::set<double> rts;
-
     // Calculate monic coefficients
     int order = (int)coeffs.size() - 1;
-    Eigen::VectorXd monicCoeffs(order + 1);
-    monicCoeffs << 1.0, coeffs.tail(order) / coeffs(0);
+    double monicCoeffs[RootFinderParam::highestOrder + 1];
+    monicCoeffs[0] = 1.0;
+    for (int i = 1; i <= order; i++)
+    {
+        monicCoeffs[i] = coeffs(i) / coeffs(0);
+    }
 
     // Calculate Cauchy’s bound for the roots of a polynomial
-    double rho_c = 1 + monicCoeffs.tail(order).cwiseAbs().maxCoeff();
+    double rho_c = 0.0;
+    for (int i = 1; i <= order; i++)
+    {
+        rho_c = std::max(rho_c, fabs(monicCoeffs[i]));
+    }
+    rho_c += 1;
 
     // Calculate Kojima’s bound for the roots of a polynomial
-    Eigen::VectorXd nonzeroCoeffs(order + 1);
-    nonzeroCoeffs.setZero();
+    double nonzeroCoeffs[RootFinderParam::highestOrder + 1];
     int nonzeros = 0;
     double tempEle;
     for (int i = 0; i < order + 1; i++)
     {
-        tempEle = monicCoeffs(i);
+        tempEle = monicCoeffs[i];
         if (fabs(tempEle) >= DBL_EPSILON)
         {
-            nonzeroCoeffs(nonzeros++) = tempEle;
+            nonzeroCoeffs[nonzeros++] = tempEle;
         }
     }
-    nonzeroCoeffs = nonzeroCoeffs.head(nonzeros).eval();
-    Eigen::VectorXd kojimaVec = nonzeroCoeffs.tail(nonzeros - 1).cwiseQuotient(nonzeroCoeffs.head(nonzeros - 1)).cwiseAbs();
-    kojimaVec.tail(1) /= 2.0;
-    double rho_k = 2.0 * kojimaVec.maxCoeff();
+    double rho_k = 0.0;
+    for (int i = 1; i < nonzeros; i++)
+    {
+        tempEle = fabs(nonzeroCoeffs[i] / nonzeroCoeffs[i - 1]);
+        tempEle /= i == nonzeros - 1 ? 2.0 : 1.0;
+        rho_k = std::max(rho_k, tempEle);
+    }
+    rho_k *= 2.0;
 
     // Choose a sharper one then loosen it by 1.0 to get an open interval
     double rho = std::min(rho_c, rho_k) + 1.0;
@@ -684,7 +808,7 @@ inline std::set<double> isolateRealRoots(const Eigen::VectorXd &coeffs, double l
     ubound = std::min(ubound, rho);
 
     // Build Sturm sequence
-    int len = monicCoeffs.size();
+    int len = order + 1;
     double sturmSeqs[(RootFinderParam::highestOrder + 1) * (RootFinderParam::highestOrder + 1)];
     int szSeq[RootFinderParam::highestOrder + 1] = {0}; // Explicit ini as zero (gcc may neglect this in -O3)
     double *offsetSeq[RootFinderParam::highestOrder + 1];
@@ -692,7 +816,7 @@ inline std::set<double> isolateRealRoots(const Eigen::VectorXd &coeffs, double l
 
     for (int i = 0; i < len; i++)
     {
-        sturmSeqs[i] = monicCoeffs(i);
+        sturmSeqs[i] = monicCoeffs[i];
         sturmSeqs[i + 1 + len] = (order - i) * sturmSeqs[i] / order;
     }
     szSeq[0] = len;
@@ -729,8 +853,16 @@ inline std::set<double> isolateRealRoots(const Eigen::VectorXd &coeffs, double l
                  numSignVar(lbound, offsetSeq, szSeq, len),
                  numSignVar(ubound, offsetSeq, szSeq, len),
                  tol, offsetSeq, szSeq, len, rts);
+}
 
-    return rts;
+inline std::set<double> isolateRealRoots(const Eigen::VectorXd &coeffs, double lbound, double ubound, double tol)
+// Calculate roots of coeffs(x) inside (lbound, rbound) leveraging Sturm theory
+// Requirement: leading coefficient must be nonzero
+//              coeffs(lbound) != 0, coeffs(rbound) != 0, lbound < rbound
+{
+    RootFinder::RootSet rts;
+    isolateRealRoots(coeffs, lbound, ubound, tol, rts);
+    return rts.toSet();
 }
 
 } // namespace RootFinderPriv
@@ -858,7 +990,47 @@ inline Eigen::VectorXd polySqr(const Eigen::VectorXd &coef)
     return result;
 }
 
-inline double polyVal(const Eigen::VectorXd &coeffs, double x,
+template <int Rows, int Cols>
+inline Eigen::Matrix<double, 2 * Cols - 1, 1> polySqrSum(const Eigen::Matrix<double, Rows, Cols> &coefs)
+// Calculate the sum of the self-convolutions of all rows of coefs, i.e., the squared
+// norm of a vector polynomial. Same arithmetic as summing polySqr of every row,
+// but the sizes are fixed so nothing is allocated
+{
+    constexpr int resultSize = 2 * Cols - 1;
+    Eigen::Matrix<double, resultSize, 1> result;
+    int lbound, rbound;
+    double temp;
+    for (int d = 0; d < Rows; d++)
+    {
+        for (int i = 0; i < resultSize; i++)
+        {
+            temp = 0;
+            lbound = i - Cols + 1;
+            lbound = lbound > 0 ? lbound : 0;
+            rbound = Cols < (i + 1) ? Cols : (i + 1);
+            rbound += lbound;
+            if (rbound & 1)
+            {
+                rbound >>= 1;
+                temp += coefs(d, rbound) * coefs(d, rbound);
+            }
+            else
+            {
+                rbound >>= 1;
+            }
+
+            for (int j = lbound; j < rbound; j++)
+            {
+                temp += 2.0 * coefs(d, j) * coefs(d, i - j);
+            }
+            result(i) = d == 0 ? temp : result(i) + temp;
+        }
+    }
+
+    return result;
+}
+
+inline double polyVal(const Eigen::Ref<const Eigen::VectorXd> &coeffs, double x,
                       bool numericalStability = true)
 // Evaluate the polynomial at x, i.e., coeffs(x)
 // Horner scheme is faster yet less stable
@@ -904,7 +1076,7 @@ inline double polyVal(const Eigen::VectorXd &coeffs, double x,
     return retVal;
 }
 
-inline int countRoots(const Eigen::VectorXd &coeffs, double l, double r)
+inline int countRoots(const Eigen::Ref<const Eigen::VectorXd> &coeffs, double l, double r)
 // Count the number of distinct roots of coeffs(x) inside (l, r), leveraging Sturm theory
 // Boundary values, i.e., coeffs(l) and coeffs(r), must be nonzero
 {
@@ -926,11 +1098,15 @@ inline int countRoots(const Eigen::VectorXd &coeffs, double l, double r)
 
     if (valid > 0 && fabs(coeffs(originalSize - 1)) > DBL_EPSILON)
     {
-        Eigen::VectorXd monicCoeffs(valid);
-        monicCoeffs << 1.0, coeffs.segment(originalSize - valid + 1, valid - 1) / coeffs(originalSize - valid);
+        double monicCoeffs[RootFinderParam::highestOrder + 1];
+        monicCoeffs[0] = 1.0;
+        for (int i = 1; i < valid; i++)
+        {
+            monicCoeffs[i] = coeffs(originalSize - valid + i) / coeffs(originalSize - valid);
+        }
 
         // Build the Sturm sequence
-        int len = monicCoeffs.size();
+        int len = valid;
         int order = len - 1;
         double sturmSeqs[(RootFinderParam::highestOrder + 1) * (RootFinderParam::highestOrder + 1)];
         int szSeq[RootFinderParam::highestOrder + 1] = {0}; // Explicit ini as zero (gcc may neglect this in -O3)
@@ -938,7 +1114,7 @@ inline int countRoots(const Eigen::VectorXd &coeffs, double l, double r)
 
         for (int i = 0; i < len; i++)
         {
-            sturmSeqs[i] = monicCoeffs(i);
+            sturmSeqs[i] = monicCoeffs[i];
             sturmSeqs[i + 1 + len] = (order - i) * sturmSeqs[i] / order;
         }
         szSeq[0] = len;
@@ -987,8 +1163,10 @@ inline int countRoots(const Eigen::VectorXd &coeffs, double l, double r)
     return nRoots;
 }
 
-inline std::set<double> solvePolynomial(const Eigen::VectorXd &coeffs, double lbound, double ubound, double tol, bool isolation = true)
-// Calculate roots of coeffs(x) inside (lbound, rbound)
+inline void solvePolynomial(const Eigen::Ref<const Eigen::VectorXd> &coeffs, double lbound, double ubound, double tol,
+                            RootSet &rts, bool isolation = true)
+// Calculate roots of coeffs(x) inside (lbound, rbound), rts is cleared and filled with them
+// Nothing is allocated unless isolation is false
 //
 // Closed-form solutions are employed for reduced_order < 5
 // isolation = true:
@@ -1000,7 +1178,7 @@ inline std::set<double> solvePolynomial(const Eigen::VectorXd &coeffs, double lb
 // Requirement: leading coefficient must be nonzero
 //              coeffs(lbound) != 0, coeffs(rbound) != 0, lbound < rbound
 {
-    std::set<double> rts;
+    rts.clear();
 
     int valid = coeffs.size();
     for (int i = 0; i < coeffs.size(); i++)
@@ -1044,23 +1222,26 @@ inline std::set<double> solvePolynomial(const Eigen::VectorXd &coeffs, double lb
     }
     else
     {
-        Eigen::VectorXd ncoeffs(std::max(5, nonzeros));
+        Eigen::Matrix<double, Eigen::Dynamic, 1, 0, RootFinderParam::highestOrder + 1, 1> ncoeffs(std::max(5, nonzeros));
         ncoeffs.setZero();
         ncoeffs.tail(nonzeros) << coeffs.segment(coeffs.size() - valid, nonzeros);
 
         if (nonzeros <= 5)
         {
-            rts = RootFinderPriv::solveQuart(ncoeffs(0), ncoeffs(1), ncoeffs(2), ncoeffs(3), ncoeffs(4));
+            RootFinderPriv::solveQuart(ncoeffs(0), ncoeffs(1), ncoeffs(2), ncoeffs(3), ncoeffs(4), rts);
         }
         else
         {
             if (isolation)
             {
-                rts = RootFinderPriv::isolateRealRoots(ncoeffs, lbound, ubound, tol);
+                RootFinderPriv::isolateRealRoots(ncoeffs, lbound, ubound, tol, rts);
             }
             else
             {
-                rts = RootFinderPriv::eigenSolveRealRoots(ncoeffs, lbound, ubound, tol);
+                for (double x : RootFinderPriv::eigenSolveRealRoots(ncoeffs, lbound, ubound, tol))
+                {
+                    rts.insert(x);
+                }
             }
         }
 
@@ -1070,19 +1251,16 @@ inline std::set<double> solvePolynomial(const Eigen::VectorXd &coeffs, double lb
         }
     }
 
-    for (auto it = rts.begin(); it != rts.end();)
-    {
-        if (*it > lbound && *it < ubound)
-        {
-            it++;
-        }
-        else
-        {
-            it = rts.erase(it);
-        }
-    }
+    rts.keepWithin(lbound, ubound);
+}
 
-    return rts;
+inline std::set<double> solvePolynomial(const Eigen::VectorXd &coeffs, double lbound, double ubound, double tol, bool isolation = true)
+// Calculate roots of coeffs(x) inside (lbound, rbound)
+// Same as above, see there for the requirements
+{
+    RootSet rts;
+    solvePolynomial(coeffs, lbound, ubound, tol, rts, isolation);
+    return rts.toSet();
 }
 
 } // namespace RootFinder
@@ -0,0 +1,656 @@
+/*
+* sensor_map.h
+*
+* ---------------------------------------------------------------------
+* Copyright (C) 2022 Matthew (matthewoots at gmail.com)
+*
+*  This program is free software; you can redistribute it and/or
+*  modify it under the terms of the GNU General Public License
+*  as published by the Free Software Foundation; either version 2
+*  of the License, or (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+* ---------------------------------------------------------------------
+*/
+#ifndef SENSOR_MAP_H
+#define SENSOR_MAP_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <vector>
+#include <unordered_map>
+#include <Eigen/Dense>
+
+/**
+ * @brief Sensor rays stored as structure of arrays
+ * Directions are unit vectors, range is the length of each ray
+**/
+struct ray_table
+{
+    Eigen::ArrayXf x, y, z;
+    Eigen::ArrayXf range;
+
+    void resize(int n)
+    {
+        x.resize(n); y.resize(n); z.resize(n); range.resize(n);
+    }
+
+    int size() const { return (int)range.size(); }
+
+    /** @brief Rotate all the directions by r into out, ranges are copied **/
+    void rotate(const Eigen::Matrix3f &r, ray_table &out) const
+    {
+        out.resize(size());
+        out.x = r(0,0) * x + r(0,1) * y + r(0,2) * z;
+        out.y = r(1,0) * x + r(1,1) * y + r(1,2) * z;
+        out.z = r(2,0) * x + r(2,1) * y + r(2,2) * z;
+        out.range = range;
+    }
+
+    /**
+     * @brief Rays of a v_p x h_p pixel sensor spanning vfov x hfov (rad)
+     * Rays are stored tile by tile so that each packet of p_s x p_s rays is
+     * contiguous, offsets gets the first ray of every packet and the end.
+     * The ray reaches the plane at max_range, (cos(h), sin(h), tan(v)) is
+     * scaled by cos(v) to get a unit direction and max_range / cos(v)
+    **/
+    void set_fov(double vfov, double hfov, int v_p, int h_p, double max_range,
+        int p_s, std::vector<int> &offsets)
+    {
+        double v_s = vfov / (double)v_p;
+        double h_s = hfov / (double)h_p;
+        p_s = std::max(p_s, 1);
+
+        resize(v_p * h_p);
+        offsets.assign(1, 0);
+        int n_rays = 0;
+        for (int t_i = 0; t_i < v_p; t_i += p_s)
+            for (int t_j = 0; t_j < h_p; t_j += p_s)
+            {
+                for (int i = t_i; i < std::min(t_i + p_s, v_p); i++)
+                {
+                    double v = i*v_s - vfov/2.0;
+                    for (int j = t_j; j < std::min(t_j + p_s, h_p); j++)
+                    {
+                        double h = j*h_s - hfov/2.0;
+                        x(n_rays) = (float)(std::cos(v) * std::cos(h));
+                        y(n_rays) = (float)(std::cos(v) * std::sin(h));
+                        z(n_rays) = (float)std::sin(v);
+                        range(n_rays) = (float)(max_range / std::cos(v));
+                        n_rays++;
+                    }
+                }
+                offsets.push_back(n_rays);
+            }
+    }
+};
+
+/**
+ * @brief Occupancy map used by the simulated sensor
+ * Voxels are grouped into bricks of 8x8x8 bits that are stored in a hash map,
+ * rays are cast in packets that share one origin so that every brick touched by
+ * the packet is looked up once and reused by all the rays in it.
+ * Bricks are copy on write, copies of a map share the bricks they have in common
+**/
+class sensor_map
+{
+    public:
+
+        static constexpr int brick_bits = 3;
+        static constexpr int brick_size = 1 << brick_bits;
+
+        struct brick
+        {
+            // One 64 bit word per z slice, bit index is x + y * brick_size
+            uint64_t slice[brick_size] = {0};
+
+            inline bool test(int x, int y, int z) const
+            {
+                return (slice[z] >> (x + y * brick_size)) & 1u;
+            }
+
+            inline void set(int x, int y, int z)
+            {
+                slice[z] |= (uint64_t)1 << (x + y * brick_size);
+            }
+
+            inline void reset(int x, int y, int z)
+            {
+                slice[z] &= ~((uint64_t)1 << (x + y * brick_size));
+            }
+
+            inline int count() const
+            {
+                int c = 0;
+                for (int z = 0; z < brick_size; z++)
+                    c += __builtin_popcountll(slice[z]);
+                return c;
+            }
+        };
+
+        /** @brief Scratch memory of a packet query, reuse it between calls **/
+        struct packet_cache
+        {
+            std::vector<const brick*> table;
+            // Set voxels of one brick as structure of arrays, see get_first_blocked_segment
+            std::vector<float> x, y, z;
+        };
+
+        sensor_map() : resolution(1.0) {}
+
+        void set_resolution(double r)
+        {
+            resolution = r;
+            bricks.clear();
+        }
+
+        double get_resolution() const { return resolution; }
+
+        void clear() { bricks.clear(); }
+
+        bool empty() const { return bricks.empty(); }
+
+        void insert(const Eigen::Vector3d &p)
+        {
+            Eigen::Vector3i v = get_voxel(p);
+            Eigen::Vector3i b = get_brick(v);
+            std::shared_ptr<brick> &br = bricks[get_key(b)];
+            if (!br)
+                br = std::make_shared<brick>();
+            else if (br.use_count() > 1)
+                br = std::make_shared<brick>(*br);
+            br->set(
+                v.x() - b.x() * brick_size,
+                v.y() - b.y() * brick_size,
+                v.z() - b.z() * brick_size);
+        }
+
+        /** @brief Free the voxel of p, a brick left empty is dropped **/
+        void erase(const Eigen::Vector3d &p)
+        {
+            Eigen::Vector3i v = get_voxel(p);
+            Eigen::Vector3i b = get_brick(v);
+            auto it = bricks.find(get_key(b));
+            int x = v.x() - b.x() * brick_size;
+            int y = v.y() - b.y() * brick_size;
+            int z = v.z() - b.z() * brick_size;
+            if (it == bricks.end() || !it->second->test(x, y, z))
+                return;
+            if (it->second->count() == 1)
+            {
+                bricks.erase(it);
+                return;
+            }
+            if (it->second.use_count() > 1)
+                it->second = std::make_shared<brick>(*it->second);
+            it->second->reset(x, y, z);
+        }
+
+        /**
+         * @brief Compare this map against the previous version of it
+         * Bricks that did not change are swapped for the ones of previous, so
+         * both versions share them, and the changed voxels are counted
+         * @return true if any voxel was inserted or removed
+        **/
+        bool diff_and_share(
+            const sensor_map &previous, size_t &inserted, size_t &removed)
+        {
+            inserted = removed = 0;
+            if (previous.resolution != resolution)
+            {
+                for (auto &it : previous.bricks)
+                    removed += it.second->count();
+                for (auto &it : bricks)
+                    inserted += it.second->count();
+                return inserted > 0 || removed > 0;
+            }
+
+            for (auto &it : bricks)
+            {
+                auto prev = previous.bricks.find(it.first);
+                if (prev == previous.bricks.end())
+                {
+                    inserted += it.second->count();
+                    continue;
+                }
+
+                bool same = true;
+                for (int z = 0; z < brick_size; z++)
+                {
+                    uint64_t now = it.second->slice[z];
+                    uint64_t was = prev->second->slice[z];
+                    inserted += __builtin_popcountll(now & ~was);
+                    removed += __builtin_popcountll(was & ~now);
+                    same = same && now == was;
+                }
+                if (same)
+                    it.second = prev->second;
+            }
+
+            for (auto &it : previous.bricks)
+                if (bricks.find(it.first) == bricks.end())
+                    removed += it.second->count();
+
+            return inserted > 0 || removed > 0;
+        }
+
+        bool is_occupied(const Eigen::Vector3d &p) const
+        {
+            return test_voxel(get_voxel(p));
+        }
+
+        /** @brief Whether any voxel of the box [min, max] (voxel indices) is occupied **/
+        bool is_occupied_box(const Eigen::Vector3i &min, const Eigen::Vector3i &max) const
+        {
+            Eigen::Vector3i b0 = get_brick(min), b1 = get_brick(max);
+            Eigen::Vector3i b;
+            for (b.x() = b0.x(); b.x() <= b1.x(); b.x()++)
+                for (b.y() = b0.y(); b.y() <= b1.y(); b.y()++)
+                    for (b.z() = b0.z(); b.z() <= b1.z(); b.z()++)
+                    {
+                        auto it = bricks.find(get_key(b));
+                        if (it == bricks.end())
+                            continue;
+
+                        // Part of the box inside this brick, in brick local indices
+                        Eigen::Vector3i lo = (min - b * brick_size).cwiseMax(0);
+                        Eigen::Vector3i hi = (max - b * brick_size).cwiseMin(brick_size - 1);
+                        for (int z = lo.z(); z <= hi.z(); z++)
+                            for (int y = lo.y(); y <= hi.y(); y++)
+                                for (int x = lo.x(); x <= hi.x(); x++)
+                                    if (it->second->test(x, y, z))
+                                        return true;
+                    }
+            return false;
+        }
+
+        /** @brief Whether the center of an occupied voxel lies within radius of p **/
+        bool is_occupied_within(const Eigen::Vector3d &p, double radius) const
+        {
+            if (bricks.empty())
+                return false;
+
+            Eigen::Vector3i c = get_voxel(p);
+            int n = (int)std::ceil(radius / resolution);
+            double r_sq = radius * radius;
+            for (int x = -n; x <= n; x++)
+                for (int y = -n; y <= n; y++)
+                    for (int z = -n; z <= n; z++)
+                    {
+                        Eigen::Vector3i v = c + Eigen::Vector3i(x, y, z);
+                        Eigen::Vector3d center = (v.cast<double>() +
+                            Eigen::Vector3d::Constant(0.5)) * resolution;
+                        if ((center - p).squaredNorm() <= r_sq && test_voxel(v))
+                            return true;
+                    }
+            return false;
+        }
+
+        /** @brief Visit the center of every occupied voxel, in no particular order **/
+        template <typename Visit>
+        void for_each_occupied(Visit visit) const
+        {
+            for (const auto &it : bricks)
+            {
+                Eigen::Vector3i origin = get_key_brick(it.first) * brick_size;
+                for (int k = 0; k < brick_size; k++)
+                    for (uint64_t bits = it.second->slice[k]; bits != 0; bits &= bits - 1)
+                    {
+                        int bit = __builtin_ctzll(bits);
+                        Eigen::Vector3i v = origin + Eigen::Vector3i(
+                            bit % brick_size, bit / brick_size, k);
+                        visit(((v.cast<double>() + 
+                            Eigen::Vector3d::Constant(0.5)) * resolution).eval());
+                    }
+            }
+        }
+
+        /**
+         * @brief Cast a packet of neighbouring rays from a common origin
+         * @param origin start point of all the rays
+         * @param rays world frame rays, the packet is [begin, end)
+         * @param hits the voxel center of the first occupied voxel of every
+         * ray that is blocked is appended here
+        **/
+        void cast_packet(
+            const Eigen::Vector3d &origin, const ray_table &rays, int begin, int end,
+            packet_cache &cache, std::vector<Eigen::Vector3d> &hits) const
+        {
+            if (end <= begin || bricks.empty())
+                return;
+
+            // Bounding box of the packet, which contains every segment in it
+            Eigen::Vector3d a = origin / resolution;
+            Eigen::Vector3d min_v = a, max_v = a;
+            for (int i = begin; i < end; i++)
+            {
+                Eigen::Vector3d b = get_ray_end(a, rays, i);
+                min_v = min_v.cwiseMin(b);
+                max_v = max_v.cwiseMax(b);
+            }
+
+            Eigen::Vector3i b_min = get_brick(floor_vector(min_v));
+            Eigen::Vector3i b_max = get_brick(floor_vector(max_v));
+            Eigen::Vector3i b_n = b_max - b_min + Eigen::Vector3i::Ones();
+
+            // Visit the map once for the whole packet, nothing along any of the rays
+            if (!gather_bricks(b_min, b_n, cache))
+                return;
+
+            for (int i = begin; i < end; i++)
+            {
+                Eigen::Vector3i v;
+                if (traverse(a, get_ray_end(a, rays, i), b_min, b_n, cache.table, v))
+                    hits.push_back((v.cast<double>() +
+                        Eigen::Vector3d::Constant(0.5)) * resolution);
+            }
+        }
+
+        /**
+         * @brief First segment of a path that passes within radius of the
+         * center of an occupied voxel
+         * Segments are cut into pieces of at most a brick length, each piece
+         * visits the bricks around it and only tests the voxels that are set.
+         * The bricks are looked up once for a chunk of consecutive pieces, as
+         * many as fit in a box of chunk_bricks, so the lookups follow the path
+         * and not its bounding box. Segments are checked in order and the check
+         * stops at the first blocked one
+         * @return i for the segment path[i] -> path[i+1], -1 if all are clear
+        **/
+        int get_first_blocked_segment(
+            const Eigen::Vector3d *path, int n_points, double radius,
+            packet_cache &cache) const
+        {
+            if (n_points < 2 || bricks.empty())
+                return -1;
+
+            const int chunk_bricks = 64;
+
+            // Work in voxel units, voxel v has its center at v + 0.5
+            double r = radius / resolution;
+            double r_sq = r * r;
+            Eigen::Vector3d margin = Eigen::Vector3d::Constant(r);
+            // Bricks whose center is further than this cannot hold a voxel in reach
+            double half = brick_size / 2.0;
+            double brick_r = r + half * std::sqrt(3.0);
+            double brick_r_sq = brick_r * brick_r;
+
+            auto get_pieces = [&](int i)
+            {
+                return std::max((int)std::ceil((path[i+1] - path[i]).norm() / 
+                    (resolution * brick_size)), 1);
+            };
+
+            // Bricks around piece j of segment i, grown by radius
+            auto get_piece_bricks = [&](int i, int j, Eigen::Vector3i &lo, Eigen::Vector3i &hi)
+            {
+                int m = get_pieces(i);
+                Eigen::Vector3d a = path[i] / resolution;
+                Eigen::Vector3d ab = path[i+1] / resolution - a;
+                Eigen::Vector3d p0 = a + ab * ((double)j / m);
+                Eigen::Vector3d p1 = a + ab * ((double)(j + 1) / m);
+                lo = get_brick(floor_vector(p0.cwiseMin(p1) - margin));
+                hi = get_brick(floor_vector(p0.cwiseMax(p1) + margin));
+            };
+
+            Eigen::Vector3i b_min, b_n;
+            bool any = false;
+            // First piece past the gathered chunk, end_k can be the piece count
+            int end_i = 0, end_k = 0;
+
+            const int brick_voxels = brick_size * brick_size * brick_size;
+            cache.x.resize(brick_voxels);
+            cache.y.resize(brick_voxels);
+            cache.z.resize(brick_voxels);
+            float *v_x = cache.x.data(), *v_y = cache.y.data(), *v_z = cache.z.data();
+
+            for (int i = 0; i + 1 < n_points; i++)
+            {
+                Eigen::Vector3d a = path[i] / resolution;
+                Eigen::Vector3d ab = path[i+1] / resolution - a;
+                double ab_sq = ab.squaredNorm();
+
+                auto get_dist_sq = [&](const Eigen::Vector3d &c)
+                {
+                    double s = ab_sq > 0.0 ?
+                        std::min(std::max((c - a).dot(ab) / ab_sq, 0.0), 1.0) : 0.0;
+                    return (a + s * ab - c).squaredNorm();
+                };
+
+                // The set voxels of a brick are measured together, in floats
+                // relative to a and without branches so that the loop vectorizes
+                const float ab_x = (float)ab.x(), ab_y = (float)ab.y(), ab_z = (float)ab.z();
+                const float inv_ab_sq = ab_sq > 0.0 ? (float)(1.0 / ab_sq) : 0.0f;
+                const float r_sq_f = (float)r_sq;
+                auto any_within = [=](int n)
+                {
+                    int within = 0;
+                    for (int b = 0; b < n; b++)
+                    {
+                        float t = (v_x[b] * ab_x + v_y[b] * ab_y + v_z[b] * ab_z) * inv_ab_sq;
+                        // Clamped to [0, 1] with no compare
+                        t = 0.5f * (std::fabs(t) - std::fabs(t - 1.0f) + 1.0f);
+                        float d_x = t * ab_x - v_x[b];
+                        float d_y = t * ab_y - v_y[b];
+                        float d_z = t * ab_z - v_z[b];
+                        within |= d_x * d_x + d_y * d_y + d_z * d_z <= r_sq_f;
+                    }
+                    return within != 0;
+                };
+
+                int m = get_pieces(i);
+                for (int j = 0; j < m; j++)
+                {
+                    Eigen::Vector3i lo, hi;
+                    get_piece_bricks(i, j, lo, hi);
+
+                    // Gather the next chunk, at least this piece
+                    if (i > end_i || (i == end_i && j >= end_k))
+                    {
+                        Eigen::Vector3i c_min = lo, c_max = hi;
+                        end_i = i;
+                        end_k = j + 1;
+                        while (true)
+                        {
+                            int n_i = end_i, n_k = end_k;
+                            if (n_k >= get_pieces(n_i))
+                            {
+                                n_i++;
+                                n_k = 0;
+                            }
+                            if (n_i + 1 >= n_points)
+                                break;
+
+                            Eigen::Vector3i n_lo, n_hi;
+                            get_piece_bricks(n_i, n_k, n_lo, n_hi);
+                            Eigen::Vector3i n = c_max.cwiseMax(n_hi) - 
+                                c_min.cwiseMin(n_lo) + Eigen::Vector3i::Ones();
+                            if (n.x() * n.y() * n.z() > chunk_bricks)
+                                break;
+
+                            c_min = c_min.cwiseMin(n_lo);
+                            c_max = c_max.cwiseMax(n_hi);
+                            end_i = n_i;
+                            end_k = n_k + 1;
+                        }
+
+                        b_min = c_min;
+                        b_n = c_max - c_min + Eigen::Vector3i::Ones();
+                        any = gather_bricks(b_min, b_n, cache);
+                    }
+
+                    // Nothing around the chunk
+                    if (!any)
+                        continue;
+
+                    Eigen::Vector3i l_min = lo - b_min, l_max = hi - b_min;
+                    for (int x = l_min.x(); x <= l_max.x(); x++)
+                        for (int y = l_min.y(); y <= l_max.y(); y++)
+                            for (int z = l_min.z(); z <= l_max.z(); z++)
+                            {
+                                const brick *br = cache.table[(x * b_n.y() + y) * b_n.z() + z];
+                                if (br == nullptr)
+                                    continue;
+
+                                Eigen::Vector3d origin =
+                                    ((b_min + Eigen::Vector3i(x, y, z)) * brick_size).cast<double>();
+                                if (get_dist_sq(origin + Eigen::Vector3d::Constant(half)) > brick_r_sq)
+                                    continue;
+
+                                // Only the voxels that are set
+                                Eigen::Vector3f o = (origin - a).cast<float>() +
+                                    Eigen::Vector3f::Constant(0.5f);
+                                int n = 0;
+                                for (int k = 0; k < brick_size; k++)
+                                    for (uint64_t bits = br->slice[k]; bits != 0; bits &= bits - 1)
+                                    {
+                                        int bit = __builtin_ctzll(bits);
+                                        v_x[n] = o.x() + (float)(bit % brick_size);
+                                        v_y[n] = o.y() + (float)(bit / brick_size);
+                                        v_z[n] = o.z() + (float)k;
+                                        n++;
+                                    }
+                                if (any_within(n))
+                                    return i;
+                            }
+                }
+            }
+            return -1;
+        }
+
+    private:
+
+        double resolution;
+        std::unordered_map<uint64_t, std::shared_ptr<brick>> bricks;
+
+        // Look up the b_n bricks from b_min into cache, false if none exists
+        bool gather_bricks(const Eigen::Vector3i &b_min, const Eigen::Vector3i &b_n,
+            packet_cache &cache) const
+        {
+            cache.table.assign(b_n.x() * b_n.y() * b_n.z(), nullptr);
+            bool any = false;
+            for (int x = 0; x < b_n.x(); x++)
+                for (int y = 0; y < b_n.y(); y++)
+                    for (int z = 0; z < b_n.z(); z++)
+                    {
+                        auto it = bricks.find(get_key(
+                            b_min + Eigen::Vector3i(x, y, z)));
+                        if (it == bricks.end())
+                            continue;
+                        cache.table[(x * b_n.y() + y) * b_n.z() + z] = it->second.get();
+                        any = true;
+                    }
+            return any;
+        }
+
+        static inline Eigen::Vector3i floor_vector(const Eigen::Vector3d &p)
+        {
+            return Eigen::Vector3i(
+                (int)std::floor(p.x()), (int)std::floor(p.y()), (int)std::floor(p.z()));
+        }
+
+        inline Eigen::Vector3i get_voxel(const Eigen::Vector3d &p) const
+        {
+            return floor_vector(p / resolution);
+        }
+
+        inline bool test_voxel(const Eigen::Vector3i &v) const
+        {
+            Eigen::Vector3i b = get_brick(v);
+            auto it = bricks.find(get_key(b));
+            if (it == bricks.end())
+                return false;
+            return it->second->test(
+                v.x() - b.x() * brick_size,
+                v.y() - b.y() * brick_size,
+                v.z() - b.z() * brick_size);
+        }
+
+        // End point of ray i in voxel units, a is the origin in voxel units
+        inline Eigen::Vector3d get_ray_end(
+            const Eigen::Vector3d &a, const ray_table &rays, int i) const
+        {
+            double l = rays.range(i) / resolution;
+            return a + l * Eigen::Vector3d(rays.x(i), rays.y(i), rays.z(i));
+        }
+
+        // Arithmetic shift floors negative voxel indices too
+        static inline Eigen::Vector3i get_brick(const Eigen::Vector3i &v)
+        {
+            return Eigen::Vector3i(
+                v.x() >> brick_bits, v.y() >> brick_bits, v.z() >> brick_bits);
+        }
+
+        static inline uint64_t get_key(const Eigen::Vector3i &b)
+        {
+            constexpr uint64_t mask = (1u << 21) - 1;
+            return (((uint64_t)b.x() & mask) << 42) |
+                (((uint64_t)b.y() & mask) << 21) | ((uint64_t)b.z() & mask);
+        }
+
+        // Inverse of get_key, the 21 bit fields are sign extended
+        static inline Eigen::Vector3i get_key_brick(uint64_t key)
+        {
+            return Eigen::Vector3i(
+                (int)((int64_t)(key >> 42 << 43) >> 43),
+                (int)((int64_t)(key >> 21 << 43) >> 43),
+                (int)((int64_t)(key << 43) >> 43));
+        }
+
+        /**
+         * @brief Walk the voxels along a -> b (in voxel units) using the bricks
+         * gathered for the packet, returns true and the voxel at the first hit
+        **/
+        static bool traverse(
+            const Eigen::Vector3d &a, const Eigen::Vector3d &b,
+            const Eigen::Vector3i &b_min, const Eigen::Vector3i &b_n,
+            const std::vector<const brick*> &table, Eigen::Vector3i &v)
+        {
+            const double inf = std::numeric_limits<double>::infinity();
+            Eigen::Vector3d d = b - a;
+            Eigen::Vector3i step, end = floor_vector(b);
+            Eigen::Vector3d t_max, t_delta;
+
+            v = floor_vector(a);
+            for (int k = 0; k < 3; k++)
+            {
+                step(k) = d(k) > 0.0 ? 1 : (d(k) < 0.0 ? -1 : 0);
+                t_delta(k) = step(k) != 0 ? 1.0 / std::fabs(d(k)) : inf;
+                t_max(k) = step(k) > 0 ? (v(k) + 1 - a(k)) * t_delta(k) :
+                    (step(k) < 0 ? (a(k) - v(k)) * t_delta(k) : inf);
+            }
+
+            while (true)
+            {
+                Eigen::Vector3i bv = get_brick(v);
+                Eigen::Vector3i l = bv - b_min;
+                // Guard against rounding at the far end of the packet box
+                if ((l.array() < 0).any() || (l.array() >= b_n.array()).any())
+                    return false;
+                const brick *br = table[(l.x() * b_n.y() + l.y()) * b_n.z() + l.z()];
+                if (br != nullptr && br->test(
+                    v.x() - bv.x() * brick_size,
+                    v.y() - bv.y() * brick_size,
+                    v.z() - bv.z() * brick_size))
+                    return true;
+
+                if (v == end)
+                    return false;
+
+                int k;
+                t_max.minCoeff(&k);
+                if (t_max(k) > 1.0)
+                    return false;
+                v(k) += step(k);
+                t_max(k) += t_delta(k);
+            }
+        }
+};
+
+#endif
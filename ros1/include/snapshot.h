@@ -0,0 +1,126 @@
+/*
+* snapshot.h
+*
+* ---------------------------------------------------------------------
+* Copyright (C) 2022 Matthew (matthewoots at gmail.com)
+*
+*  This program is free software; you can redistribute it and/or
+*  modify it under the terms of the GNU General Public License
+*  as published by the Free Software Foundation; either version 2
+*  of the License, or (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+* ---------------------------------------------------------------------
+*/
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+
+/**
+ * @brief Seqlock protected value for small plain structs
+ * Readers never block, they copy the value and retry if a write happened
+ * meanwhile. Writers are serialized among themselves only.
+ * The value is kept as relaxed atomic words, so a read that overlaps a write
+ * is not a data race, it only gets discarded. T is copied bitwise, it has to
+ * be plain data, fixed size Eigen types included
+**/
+template <typename T>
+class seqlock_snapshot
+{
+    static_assert(std::is_standard_layout<T>::value &&
+        std::is_trivially_destructible<T>::value,
+        "seqlock_snapshot copies its value bitwise");
+
+    public:
+
+        seqlock_snapshot() : seq(0)
+        {
+            for (std::atomic<uint64_t> &w : words)
+                w.store(0, std::memory_order_relaxed);
+        }
+
+        explicit seqlock_snapshot(const T &v) : seqlock_snapshot() { write(v); }
+
+        T load() const
+        {
+            uint64_t buffer[n_words];
+            unsigned long s0, s1;
+            do
+            {
+                s0 = seq.load(std::memory_order_acquire);
+                for (size_t i = 0; i < n_words; i++)
+                    buffer[i] = words[i].load(std::memory_order_relaxed);
+                std::atomic_thread_fence(std::memory_order_acquire);
+                s1 = seq.load(std::memory_order_relaxed);
+            }
+            while ((s0 & 1) || s0 != s1);
+
+            T out;
+            memcpy(static_cast<void *>(&out), buffer, sizeof(T));
+            return out;
+        }
+
+        void store(const T &v)
+        {
+            std::lock_guard<std::mutex> lock(writer_mutex);
+            write(v);
+        }
+
+    private:
+
+        static constexpr size_t n_words = (sizeof(T) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+        std::atomic<unsigned long> seq; // odd while a write is in progress
+        std::atomic<uint64_t> words[n_words];
+        std::mutex writer_mutex;
+
+        void write(const T &v)
+        {
+            uint64_t buffer[n_words] = {0};
+            memcpy(buffer, static_cast<const void *>(&v), sizeof(T));
+
+            unsigned long s = seq.load(std::memory_order_relaxed);
+            seq.store(s + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            for (size_t i = 0; i < n_words; i++)
+                words[i].store(buffer[i], std::memory_order_relaxed);
+            seq.store(s + 2, std::memory_order_release);
+        }
+};
+
+/**
+ * @brief Immutable value published through an atomic shared pointer
+ * Readers keep the version they loaded alive for as long as they need it
+**/
+template <typename T>
+class shared_snapshot
+{
+    public:
+
+        shared_snapshot() : ptr(std::make_shared<const T>()) {}
+
+        std::shared_ptr<const T> load() const
+        {
+            return std::atomic_load(&ptr);
+        }
+
+        void store(std::shared_ptr<const T> v)
+        {
+            std::atomic_store(&ptr, std::move(v));
+        }
+
+    private:
+
+        std::shared_ptr<const T> ptr;
+};
+
+#endif
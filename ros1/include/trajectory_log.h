@@ -0,0 +1,301 @@
+/*
+* trajectory_log.h
+*
+* ---------------------------------------------------------------------
+* Copyright (C) 2022 Matthew (matthewoots at gmail.com)
+*
+*  This program is free software; you can redistribute it and/or
+*  modify it under the terms of the GNU General Public License
+*  as published by the Free Software Foundation; either version 2
+*  of the License, or (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+* ---------------------------------------------------------------------
+*/
+#ifndef TRAJECTORY_LOG_H
+#define TRAJECTORY_LOG_H
+
+#include "am_traj.hpp"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * @brief Binary log of committed trajectories, host byte order
+ * file    : file_header, then records until the end of the file
+ * record  : record_header, then record_header::pieces pieces
+ * piece   : duration, normalized coefficient matrix in column major order,
+ *           1 + TrajDim * (TrajOrder + 1) doubles
+ * The time window is in seconds since the system clock epoch. Every field
+ * is 8 byte aligned from the start of the file, so a mapped log is read in
+ * place. A record cut short by a crash ends the log
+**/
+namespace trajectory_log
+{
+    static const char magic[8] = {'L', 'R', 'O', 'T', 'R', 'A', 'J', '\0'};
+    static const uint32_t version = 1;
+
+    struct file_header
+    {
+        char magic[8];
+        uint32_t version;
+        uint32_t dim; // TrajDim of the writer
+        uint32_t order; // TrajOrder of the writer
+        uint32_t reserved[3];
+    };
+
+    struct record_header
+    {
+        double start_time, end_time;
+        uint32_t pieces;
+        uint32_t reserved;
+    };
+
+    static_assert(sizeof(file_header) == 32 && sizeof(record_header) == 24,
+        "the log layout must not depend on the compiler");
+
+    /** @brief Doubles per piece **/
+    static const size_t piece_stride = 1 + TrajDim * (TrajOrder + 1);
+
+    /**
+     * @brief Appends records to a memory buffer that is written out by flush,
+     * or once it holds flush_size bytes. Call flush after the records of one
+     * commit, so that a crash only loses the commit being logged
+    **/
+    class writer
+    {
+        public:
+
+            explicit writer(const std::string &file, size_t flush_size = 1 << 16) :
+                limit(flush_size)
+            {
+                fp = fopen(file.c_str(), "wb");
+                if (!fp)
+                    return;
+
+                file_header h;
+                memset(&h, 0, sizeof(h));
+                memcpy(h.magic, magic, sizeof(magic));
+                h.version = version;
+                h.dim = TrajDim;
+                h.order = TrajOrder;
+                put(&h, sizeof(h));
+                buffer.reserve(limit + sizeof(record_header));
+            }
+
+            ~writer()
+            {
+                if (flush())
+                    fclose(fp);
+            }
+
+            writer(const writer &) = delete;
+            writer &operator=(const writer &) = delete;
+
+            bool is_open() const { return fp != nullptr; }
+
+            void append(double start_time, double end_time, const Trajectory &traj)
+            {
+                if (!fp)
+                    return;
+
+                record_header h;
+                memset(&h, 0, sizeof(h));
+                h.start_time = start_time;
+                h.end_time = end_time;
+                h.pieces = (uint32_t)traj.getPieceNum();
+                put(&h, sizeof(h));
+
+                for (int i = 0; i < traj.getPieceNum(); i++)
+                {
+                    double d = traj[i].getDuration();
+                    CoefficientMat c = traj[i].getCoeffMat(true);
+                    put(&d, sizeof(d));
+                    put(c.data(), sizeof(double) * c.size());
+                }
+
+                if (buffer.size() >= limit)
+                    flush();
+            }
+
+            /**
+             * @brief Writes the buffer out, false if the file is not open or
+             * the write failed. A failed write closes the file, so a log is
+             * never continued after a partial record
+            **/
+            bool flush()
+            {
+                if (!fp)
+                    return false;
+                if (buffer.empty())
+                    return true;
+                bool written =
+                    fwrite(buffer.data(), 1, buffer.size(), fp) == buffer.size() &&
+                    fflush(fp) == 0;
+                buffer.clear();
+                if (!written)
+                {
+                    fclose(fp);
+                    fp = nullptr;
+                }
+                return written;
+            }
+
+        private:
+
+            FILE *fp;
+            size_t limit;
+            std::vector<char> buffer;
+
+            void put(const void *p, size_t n)
+            {
+                const char *c = static_cast<const char *>(p);
+                buffer.insert(buffer.end(), c, c + n);
+            }
+    };
+
+    /** @brief One record of a mapped log, valid while its reader is open **/
+    class record_view
+    {
+        public:
+
+            explicit record_view(const char *p) :
+                h(reinterpret_cast<const record_header *>(p)),
+                data(reinterpret_cast<const double *>(p + sizeof(record_header))) {}
+
+            double start_time() const { return h->start_time; }
+
+            double end_time() const { return h->end_time; }
+
+            int get_piece_num() const { return (int)h->pieces; }
+
+            double get_duration(int i) const { return data[i * piece_stride]; }
+
+            /** @brief Normalized coefficients of piece i, read in place **/
+            Eigen::Map<const CoefficientMat> get_coeffs(int i) const
+            {
+                return Eigen::Map<const CoefficientMat>(data + i * piece_stride + 1);
+            }
+
+            Piece get_piece(int i) const
+            {
+                return Piece(get_duration(i), get_coeffs(i), true);
+            }
+
+            Trajectory get_trajectory() const
+            {
+                Trajectory traj;
+                traj.pieces.reserve(get_piece_num());
+                for (int i = 0; i < get_piece_num(); i++)
+                    traj.pieces.push_back(get_piece(i));
+                return traj;
+            }
+
+            /** @brief Position t seconds after start_time, only one piece is built **/
+            Eigen::Vector3d get_pos(double t) const
+            {
+                int n = get_piece_num();
+                int i = 0;
+                while (i < n - 1 && t > get_duration(i))
+                    t -= get_duration(i++);
+                return get_piece(i).getPos(t);
+            }
+
+        private:
+
+            const record_header *h;
+            const double *data;
+    };
+
+    /** @brief Maps a whole log read only and indexes its records **/
+    class reader
+    {
+        public:
+
+            reader() : base(nullptr), length(0) {}
+
+            ~reader() { close(); }
+
+            reader(const reader &) = delete;
+            reader &operator=(const reader &) = delete;
+
+            /** @brief False if the file is missing or not a log of this build **/
+            bool open(const std::string &file)
+            {
+                close();
+
+                int fd = ::open(file.c_str(), O_RDONLY);
+                if (fd < 0)
+                    return false;
+                struct stat st;
+                if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(file_header))
+                {
+                    ::close(fd);
+                    return false;
+                }
+                length = (size_t)st.st_size;
+                void *p = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+                ::close(fd);
+                if (p == MAP_FAILED)
+                {
+                    length = 0;
+                    return false;
+                }
+                base = static_cast<const char *>(p);
+
+                const file_header *h = reinterpret_cast<const file_header *>(base);
+                if (memcmp(h->magic, magic, sizeof(magic)) != 0 ||
+                    h->version != version || h->dim != TrajDim || h->order != TrajOrder)
+                {
+                    close();
+                    return false;
+                }
+
+                size_t offset = sizeof(file_header);
+                while (offset + sizeof(record_header) <= length)
+                {
+                    const record_header *r =
+                        reinterpret_cast<const record_header *>(base + offset);
+                    size_t end = offset + sizeof(record_header) +
+                        sizeof(double) * piece_stride * r->pieces;
+                    if (end > length)
+                        break;
+                    offsets.push_back(offset);
+                    offset = end;
+                }
+                return true;
+            }
+
+            void close()
+            {
+                if (base)
+                    munmap(const_cast<char *>(base), length);
+                base = nullptr;
+                length = 0;
+                offsets.clear();
+            }
+
+            size_t size() const { return offsets.size(); }
+
+            record_view operator[](size_t i) const { return record_view(base + offsets[i]); }
+
+        private:
+
+            const char *base;
+            size_t length;
+            std::vector<size_t> offsets;
+    };
+}
+
+#endif
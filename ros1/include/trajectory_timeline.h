@@ -0,0 +1,137 @@
+/*
+* trajectory_timeline.h
+*
+* ---------------------------------------------------------------------
+* Copyright (C) 2022 Matthew (matthewoots at gmail.com)
+*
+*  This program is free software; you can redistribute it and/or
+*  modify it under the terms of the GNU General Public License
+*  as published by the Free Software Foundation; either version 2
+*  of the License, or (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+* ---------------------------------------------------------------------
+*/
+#ifndef TRAJECTORY_TIMELINE_H
+#define TRAJECTORY_TIMELINE_H
+
+#include <memory>
+#include <type_traits>
+#include <vector>
+
+/**
+ * @brief Time ordered list of committed trajectories
+ * T needs a s_e_t pair holding its start and end time. Entries are shared,
+ * so copying or pruning a timeline never copies the trajectories themselves.
+ * Expired entries are dropped from the front by moving a head index
+**/
+template <typename T>
+class trajectory_timeline
+{
+    public:
+
+        typedef std::shared_ptr<const T> entry;
+        typedef typename std::decay<decltype(T().s_e_t.first)>::type time_type;
+
+        trajectory_timeline() : head(0) {}
+
+        /** @brief Only the live entries are copied **/
+        trajectory_timeline(const trajectory_timeline &other) :
+            entries(other.entries.begin() + other.head, other.entries.end()), head(0) {}
+
+        trajectory_timeline &operator=(const trajectory_timeline &other)
+        {
+            if (this != &other)
+            {
+                entries.assign(other.entries.begin() + other.head, other.entries.end());
+                head = 0;
+            }
+            return *this;
+        }
+
+        /** @brief The moved from timeline is left empty **/
+        trajectory_timeline(trajectory_timeline &&other) noexcept :
+            entries(std::move(other.entries)), head(other.head)
+        {
+            other.entries.clear();
+            other.head = 0;
+        }
+
+        trajectory_timeline &operator=(trajectory_timeline &&other) noexcept
+        {
+            if (this != &other)
+            {
+                entries = std::move(other.entries);
+                head = other.head;
+                other.entries.clear();
+                other.head = 0;
+            }
+            return *this;
+        }
+
+        size_t size() const { return entries.size() - head; }
+
+        bool empty() const { return size() == 0; }
+
+        const T &operator[](size_t i) const { return *entries[head + i]; }
+
+        const entry &at(size_t i) const { return entries[head + i]; }
+
+        const T &back() const { return *entries.back(); }
+
+        void push_back(entry e) { entries.push_back(std::move(e)); }
+
+        void replace(size_t i, entry e) { entries[head + i] = std::move(e); }
+
+        void clear()
+        {
+            entries.clear();
+            head = 0;
+        }
+
+        /** @brief Drop the entries that ended before t **/
+        void prune(const time_type &t)
+        {
+            while (head < entries.size() && entries[head]->s_e_t.second < t)
+                entries[head++].reset();
+
+            // Compact once the dead prefix is half of the storage
+            if (head > 0 && head * 2 >= entries.size())
+            {
+                entries.erase(entries.begin(), entries.begin() + head);
+                head = 0;
+            }
+        }
+
+        /**
+         * @brief First entry that has not ended at t, nullptr if every entry has
+         * cursor is the index of the previous lookup, queries that move forward
+         * in time only step from there so the lookup is amortized O(1).
+         * Set the cursor to 0 whenever a different timeline is used
+        **/
+        const T *find(const time_type &t, size_t &cursor) const
+        {
+            size_t n = size();
+            if (cursor > n)
+                cursor = 0;
+
+            // Time moved backwards, start over
+            if (cursor > 0 && !((*this)[cursor - 1].s_e_t.second < t))
+                cursor = 0;
+
+            while (cursor < n && (*this)[cursor].s_e_t.second < t)
+                cursor++;
+
+            return cursor < n ? &(*this)[cursor] : nullptr;
+        }
+
+    private:
+
+        std::vector<entry> entries;
+        size_t head; // index of the first live entry
+};
+
+#endif
@@ -0,0 +1,148 @@
+/*
+* worker_pool.h
+*
+* ---------------------------------------------------------------------
+* Copyright (C) 2022 Matthew (matthewoots at gmail.com)
+*
+*  This program is free software; you can redistribute it and/or
+*  modify it under the terms of the GNU General Public License
+*  as published by the Free Software Foundation; either version 2
+*  of the License, or (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+* ---------------------------------------------------------------------
+*/
+#ifndef WORKER_POOL_H
+#define WORKER_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Persistent pool of worker threads for data parallel loops
+ * The calling thread takes part as worker 0, so a pool of size n
+ * keeps n - 1 threads alive, one loop runs at a time
+**/
+class worker_pool
+{
+    public:
+
+        /** @brief fn(begin, end, worker) processes the tasks in [begin, end) **/
+        typedef std::function<void(int, int, int)> task_function;
+
+        explicit worker_pool(int n) : generation(0), stop(false)
+        {
+            n = std::max(n, 1);
+            for (int i = 1; i < n; i++)
+                workers.emplace_back(&worker_pool::worker_loop, this, i);
+        }
+
+        ~worker_pool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(job_mutex);
+                stop = true;
+            }
+            job_cv.notify_all();
+            for (std::thread &t : workers)
+                t.join();
+        }
+
+        worker_pool(const worker_pool &) = delete;
+        worker_pool &operator=(const worker_pool &) = delete;
+
+        int size() const { return (int)workers.size() + 1; }
+
+        /**
+         * @brief Run fn over [0, n_tasks) in chunks of grain tasks and block
+         * until every chunk is done, chunks are handed out dynamically
+        **/
+        void parallel_for(int n_tasks, int grain, const task_function &fn)
+        {
+            if (n_tasks <= 0)
+                return;
+            grain = std::max(grain, 1);
+
+            // Not worth waking anyone up
+            if (workers.empty() || n_tasks <= grain)
+            {
+                fn(0, n_tasks, 0);
+                return;
+            }
+
+            std::lock_guard<std::mutex> run_lock(run_mutex);
+            {
+                std::lock_guard<std::mutex> lock(job_mutex);
+                job = &fn;
+                job_size = n_tasks;
+                job_grain = grain;
+                next_task.store(0);
+                pending = (int)workers.size();
+                generation++;
+            }
+            job_cv.notify_all();
+
+            run_chunks(0);
+
+            std::unique_lock<std::mutex> lock(job_mutex);
+            done_cv.wait(lock, [this] { return pending == 0; });
+            job = nullptr;
+        }
+
+    private:
+
+        std::vector<std::thread> workers;
+
+        std::mutex run_mutex, job_mutex;
+        std::condition_variable job_cv, done_cv;
+
+        const task_function *job = nullptr;
+        int job_size = 0, job_grain = 1, pending = 0;
+        std::atomic<int> next_task{0};
+        unsigned long generation;
+        bool stop;
+
+        void run_chunks(int worker)
+        {
+            while (true)
+            {
+                int begin = next_task.fetch_add(job_grain);
+                if (begin >= job_size)
+                    return;
+                (*job)(begin, std::min(begin + job_grain, job_size), worker);
+            }
+        }
+
+        void worker_loop(int worker)
+        {
+            unsigned long seen = 0;
+            while (true)
+            {
+                {
+                    std::unique_lock<std::mutex> lock(job_mutex);
+                    job_cv.wait(lock, [&] { return stop || generation != seen; });
+                    if (stop)
+                        return;
+                    seen = generation;
+                }
+
+                run_chunks(worker);
+
+                {
+                    std::lock_guard<std::mutex> lock(job_mutex);
+                    pending--;
+                }
+                done_cv.notify_one();
+            }
+        }
+};
+
+#endif
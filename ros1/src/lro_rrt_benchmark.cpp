@@ -0,0 +1,358 @@
+/*
+* lro_rrt_benchmark.cpp
+*
+* ---------------------------------------------------------------------
+* Copyright (C) 2022 Matthew (matthewoots at gmail.com)
+*
+*  This program is free software; you can redistribute it and/or
+*  modify it under the terms of the GNU General Public License
+*  as published by the Free Software Foundation; either version 2
+*  of the License, or (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+* ---------------------------------------------------------------------
+*/
+
+/**
+ * @brief Offline benchmark of the planning loop, no ROS needed
+ * usage: lro_rrt_ros_benchmark <cloud.xyz> <queries.txt> [name=value ...]
+ * cloud.xyz holds one "x y z" point per line, queries.txt one
+ * "sx sy sz gx gy gz" start and goal pair per line. The parameters use the
+ * same names as the node, e.g. planning/sensor_range=5.25, and
+ * benchmark/repeat=N runs every query N times. One tree is grown and the
+ * trajectory is optimised on one thread unless planning/parallel_trees=N or
+ * amtraj/parallel/threads=N is given, so runs stay comparable across versions.
+ * The cloud is the global map, every query plans on one sensor scan of it
+ * taken from the start towards the goal, as the node plans on its local map.
+ * Stage latencies and the success rate are printed as JSON
+**/
+
+#include "lro_rrt_server.h"
+#include "am_traj.hpp"
+#include "worker_pool.h"
+#include "sensor_map.h"
+#include "ring_buffer_map.h"
+#include "path_selection.h"
+
+#include <string>
+#include <vector>
+#include <map>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <algorithm>
+#include <memory>
+#include <cmath>
+#include <Eigen/Dense>
+
+#include <pcl/point_types.h>
+#include <pcl/point_cloud.h>
+
+using namespace std;
+using namespace std::chrono;
+using namespace Eigen;
+
+/** @brief Defaults follow launch/sample.launch **/
+static map<string, double> default_parameters()
+{
+    map<string, double> p;
+    p["planning/sub_runtime_error"] = 0.005;
+    p["planning/runtime_error"] = 0.010;
+    p["planning/refinement_time"] = 0.00075;
+    p["planning/sensor_range"] = 5.25;
+    p["planning/sensor_buffer_multiplier"] = 3.0;
+    p["planning/interval"] = 0.15;
+    p["planning/resolution"] = 0.35;
+    p["planning/search_limit_hfov_min"] = 0.10;
+    p["planning/search_limit_hfov_max"] = 0.90;
+    p["planning/search_limit_vfov_min"] = 0.125;
+    p["planning/search_limit_vfov_max"] = 0.875;
+    p["planning/scaled_min_dist_from_node"] = 0.10;
+    p["planning/height_min"] = 1.0;
+    p["planning/height_max"] = 2.5;
+    p["planning/parallel_trees"] = 1;
+    p["map/size"] = 40.0;
+    p["map/resolution"] = 2.5 * 0.20;
+    p["map/vfov"] = 1.40;
+    p["map/hfov"] = 2.0944;
+    p["map/packet_size"] = 4;
+    p["sliding_map/size"] = 3.5 * 5.25;
+    p["sliding_map/resolution"] = 2.5 * 0.20;
+    p["amtraj/weight/time_regularization"] = 1024.0;
+    p["amtraj/weight/acceleration"] = 15.0;
+    p["amtraj/weight/jerk"] = 0.6;
+    p["amtraj/limits/max_vel"] = 3.5;
+    p["amtraj/limits/max_acc"] = 12.0;
+    p["amtraj/limits/iterations"] = 23;
+    p["amtraj/limits/epsilon"] = 0.2;
+    p["amtraj/parallel/threads"] = 1;
+    p["amtraj/parallel/grain"] = 16;
+    p["benchmark/repeat"] = 1;
+    return p;
+}
+
+static bool load_cloud(
+    const string &file, pcl::PointCloud<pcl::PointXYZ>::Ptr &cloud)
+{
+    ifstream in(file);
+    if (!in.is_open())
+        return false;
+
+    string line;
+    while (getline(in, line))
+    {
+        istringstream ss(line);
+        pcl::PointXYZ p;
+        if (line.empty() || line[0] == '#' || !(ss >> p.x >> p.y >> p.z))
+            continue;
+        cloud->points.push_back(p);
+    }
+    cloud->width = cloud->points.size();
+    cloud->height = 1;
+    return true;
+}
+
+static bool load_queries(
+    const string &file, vector<pair<Vector3d, Vector3d>> &queries)
+{
+    ifstream in(file);
+    if (!in.is_open())
+        return false;
+
+    string line;
+    while (getline(in, line))
+    {
+        istringstream ss(line);
+        Vector3d s, g;
+        if (line.empty() || line[0] == '#' ||
+            !(ss >> s.x() >> s.y() >> s.z() >> g.x() >> g.y() >> g.z()))
+            continue;
+        queries.push_back(make_pair(s, g));
+    }
+    return true;
+}
+
+/** @brief Nearest rank percentile of a sorted vector **/
+static double percentile(const vector<double> &sorted, double q)
+{
+    if (sorted.empty())
+        return 0.0;
+    int idx = (int)ceil(q * sorted.size()) - 1;
+    return sorted[std::min(std::max(idx, 0), (int)sorted.size() - 1)];
+}
+
+static void print_stage(const string &name, vector<double> t, bool last)
+{
+    sort(t.begin(), t.end());
+    cout << "    \"" << name << "\": {\"count\": " << t.size() <<
+        ", \"p50_ms\": " << percentile(t, 0.50) <<
+        ", \"p95_ms\": " << percentile(t, 0.95) <<
+        ", \"p99_ms\": " << percentile(t, 0.99) <<
+        ", \"max_ms\": " << (t.empty() ? 0.0 : t.back()) <<
+        "}" << (last ? "" : ",") << endl;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        cerr << "usage: " << argv[0] <<
+            " <cloud.xyz> <queries.txt> [name=value ...]" << endl;
+        return 1;
+    }
+
+    map<string, double> p = default_parameters();
+    for (int i = 3; i < argc; i++)
+    {
+        string arg(argv[i]);
+        size_t eq = arg.find('=');
+        if (eq == string::npos || p.find(arg.substr(0, eq)) == p.end())
+        {
+            cerr << "unknown parameter " << arg << endl;
+            return 1;
+        }
+        p[arg.substr(0, eq)] = stod(arg.substr(eq + 1));
+    }
+
+    pcl::PointCloud<pcl::PointXYZ>::Ptr cloud(new pcl::PointCloud<pcl::PointXYZ>);
+    vector<pair<Vector3d, Vector3d>> queries;
+    if (!load_cloud(argv[1], cloud) || !load_queries(argv[2], queries))
+    {
+        cerr << "unable to read " << argv[1] << " or " << argv[2] << endl;
+        return 1;
+    }
+
+    lro_rrt_server::parameters rrt_param;
+    rrt_param.r_e.first = p["planning/sub_runtime_error"];
+    rrt_param.r_e.second = p["planning/runtime_error"];
+    rrt_param.r_t = p["planning/refinement_time"];
+    rrt_param.s_r = p["planning/sensor_range"];
+    rrt_param.s_bf = p["planning/sensor_buffer_multiplier"];
+    rrt_param.s_i = p["planning/interval"];
+    rrt_param.r = p["planning/resolution"];
+    rrt_param.s_l_h.first = p["planning/search_limit_hfov_min"];
+    rrt_param.s_l_h.second = p["planning/search_limit_hfov_max"];
+    rrt_param.s_l_v.first = p["planning/search_limit_vfov_min"];
+    rrt_param.s_l_v.second = p["planning/search_limit_vfov_max"];
+    rrt_param.s_d_n = p["planning/scaled_min_dist_from_node"];
+    rrt_param.h_c.first = p["planning/height_min"];
+    rrt_param.h_c.second = p["planning/height_max"];
+    rrt_param.m_s = p["map/size"];
+
+    // Independent trees grown side by side, the shortest successful path wins
+    int n_trees = std::max((int)p["planning/parallel_trees"], 1);
+    vector<unique_ptr<lro_rrt_server::lro_rrt_server_node>> trees;
+    for (int i = 0; i < n_trees; i++)
+    {
+        trees.emplace_back(new lro_rrt_server::lro_rrt_server_node());
+        trees.back()->set_parameters(rrt_param);
+    }
+    worker_pool search_pool(n_trees);
+    vector<vector<Vector3d>> tree_paths(n_trees);
+    vector<char> tree_success(n_trees);
+
+    AmTraj am_traj(
+        p["amtraj/weight/time_regularization"], p["amtraj/weight/acceleration"],
+        p["amtraj/weight/jerk"], p["amtraj/limits/max_vel"],
+        p["amtraj/limits/max_acc"], (int)p["amtraj/limits/iterations"],
+        p["amtraj/limits/epsilon"]);
+
+    worker_pool traj_pool((int)p["amtraj/parallel/threads"]);
+    if (traj_pool.size() > 1)
+        am_traj.setParallelFor(
+            [&traj_pool](int n, int grain, const worker_pool::task_function &fn)
+            { traj_pool.parallel_for(n, grain, fn); },
+            (int)p["amtraj/parallel/grain"]);
+
+    // The node plans on what its sensor sees, not on the global map. The cloud
+    // is read into a sensor map like pcl2_callback does and every query
+    // raycasts it into the sliding map like local_map_timer does
+    sensor_map global_map;
+    global_map.set_resolution(p["map/resolution"]);
+    for (const pcl::PointXYZ &pt : cloud->points)
+        global_map.insert(Vector3d(pt.x, pt.y, pt.z));
+
+    int h_p = 1.5 * (int)ceil((rrt_param.s_r * tan(p["map/hfov"]/2)) / p["map/resolution"]);
+    int v_p = 1.5 * (int)ceil((rrt_param.s_r * tan(p["map/vfov"]/2)) / p["map/resolution"]);
+    ray_table sensing_rays, world_rays;
+    vector<int> packet_offset;
+    sensing_rays.set_fov(p["map/vfov"], p["map/hfov"], v_p, h_p, 
+        rrt_param.s_r, (int)p["map/packet_size"], packet_offset);
+    sensor_map::packet_cache packet_cache;
+    vector<Vector3d> hits;
+    ring_buffer_map sliding_map;
+
+    // Kept across queries like the node does
+    Trajectory traj;
+
+    vector<double> octree_t, search_t, discretize_t, trajectory_t, total_t;
+    size_t local_points = 0;
+    int runs = 0, success = 0;
+    int repeat = std::max((int)p["benchmark/repeat"], 1);
+
+    for (int k = 0; k < repeat; k++)
+        for (const pair<Vector3d, Vector3d> &q : queries)
+        {
+            // One scan from the start facing the goal into an empty window,
+            // not timed since the node does it on its own timer
+            Vector3d d = q.second - q.first;
+            Quaterniond orientation(AngleAxisd(atan2(d.y(), d.x()), Vector3d::UnitZ()));
+            sensing_rays.rotate(orientation.toRotationMatrix().cast<float>(), world_rays);
+            hits.clear();
+            for (int i = 0; i + 1 < (int)packet_offset.size(); i++)
+                global_map.cast_packet(q.first, world_rays, packet_offset[i],
+                    packet_offset[i+1], packet_cache, hits);
+
+            sliding_map.set_parameters(p["sliding_map/size"], p["sliding_map/resolution"]);
+            sliding_map.move_to(q.first);
+            for (const Vector3d &hit : hits)
+                sliding_map.insert(hit);
+
+            pcl::PointCloud<pcl::PointXYZ>::Ptr local_cloud(
+                new pcl::PointCloud<pcl::PointXYZ>);
+            local_cloud->points.resize(sliding_map.size());
+            for (int i = 0; i < sliding_map.size(); i++)
+            {
+                Vector3d pt = sliding_map.get_point(i);
+                local_cloud->points[i].x = pt.x();
+                local_cloud->points[i].y = pt.y();
+                local_cloud->points[i].z = pt.z();
+            }
+            local_cloud->width = local_cloud->points.size();
+            local_cloud->height = 1;
+            local_points += local_cloud->points.size();
+
+            runs++;
+            time_point<system_clock> timer = system_clock::now();
+
+            search_pool.parallel_for(n_trees, 1, [&](int begin, int end, int)
+            {
+                for (int i = begin; i < end; i++)
+                    trees[i]->update_pose_and_octree(local_cloud, q.first, q.second);
+            });
+            time_point<system_clock> t1 = system_clock::now();
+
+            search_pool.parallel_for(n_trees, 1, [&](int begin, int end, int)
+            {
+                for (int i = begin; i < end; i++)
+                {
+                    tree_paths[i].clear();
+                    tree_success[i] = trees[i]->get_path(tree_paths[i]);
+                }
+            });
+            int best = select_shortest_path(tree_paths, tree_success);
+            vector<Vector3d> search_path, global_search_path;
+            search_path.swap(tree_paths[best]);
+            bool found = tree_success[best];
+            time_point<system_clock> t2 = system_clock::now();
+
+            octree_t.push_back(duration<double>(t1 - timer).count()*1000);
+            search_t.push_back(duration<double>(t2 - t1).count()*1000);
+
+            if (!found || search_path.empty())
+            {
+                total_t.push_back(duration<double>(t2 - timer).count()*1000);
+                continue;
+            }
+
+            lro_rrt_server::get_discretized_path(search_path, global_search_path);
+            time_point<system_clock> t3 = system_clock::now();
+
+            am_traj.genOptimalTrajDTC(
+                global_search_path, Vector3d::Zero(), Vector3d::Zero(),
+                Vector3d::Zero(), Vector3d::Zero(), traj);
+            time_point<system_clock> t4 = system_clock::now();
+
+            discretize_t.push_back(duration<double>(t3 - t2).count()*1000);
+            trajectory_t.push_back(duration<double>(t4 - t3).count()*1000);
+            total_t.push_back(duration<double>(t4 - timer).count()*1000);
+
+            if (traj.getPieceNum() > 0)
+                success++;
+        }
+
+    cout << "{" << endl;
+    cout << "  \"cloud_points\": " << cloud->points.size() << "," << endl;
+    cout << "  \"parallel_trees\": " << n_trees << "," << endl;
+    cout << "  \"amtraj_threads\": " << traj_pool.size() << "," << endl;
+    cout << "  \"local_points_mean\": " <<
+        (runs > 0 ? (double)local_points / runs : 0.0) << "," << endl;
+    cout << "  \"runs\": " << runs << "," << endl;
+    cout << "  \"success\": " << success << "," << endl;
+    cout << "  \"success_rate\": " <<
+        (runs > 0 ? (double)success / runs : 0.0) << "," << endl;
+    cout << "  \"stages\": {" << endl;
+    print_stage("update_octree", octree_t, false);
+    print_stage("get_path", search_t, false);
+    print_stage("get_discretized_path", discretize_t, false);
+    print_stage("gen_optimal_traj", trajectory_t, false);
+    print_stage("total", total_t, true);
+    cout << "  }" << endl;
+    cout << "}" << endl;
+
+    return 0;
+}
@@ -34,74 +34,93 @@ using namespace lro_rrt_server;
 
 void lro_rrt_ros_node::pcl2_callback(const sensor_msgs::PointCloud2ConstPtr& msg)
 {
-    // Callback once and save the pointcloud
+    // Every message replaces the global map, only the bricks that changed
+    // are new, the rest is shared with the current version.
+    // Readers keep their own snapshot so nothing waits on this update
 
-    // std::lock_guard<std::mutex> pose_lock(pose_update_mutex);
+    // Read the message in place, the global map is never held as a pcl cloud
+    std::shared_ptr<sensor_map> tmp_map(new sensor_map());
+    tmp_map->set_resolution(m_p.m_r);
+    pcl2_to_sensor_map(*msg, *tmp_map);
 
-    if (!init_cloud)
+    std::shared_ptr<const sensor_map> current_map = map.load();
+    if (current_map)
     {
-        init_cloud = true;
-        full_cloud = pcl2_converter(*msg);
-        lro_rrt_server::parameters map_param = rrt_param;
-        map_param.r = m_p.m_r;
-        map.set_parameters(map_param);
-        map.update_pose_and_octree(full_cloud, current_point, goal);
-
-        map_param.r = m_p.s_m_r;
-        sliding_map.set_parameters(map_param);
+        size_t inserted, removed;
+        if (!tmp_map->diff_and_share(*current_map, inserted, removed))
+            return;
+
+        std::cout << "global map update, inserted(" << KGRN << inserted << KNRM << 
+            ") removed(" << KGRN << removed << KNRM << ")" << std::endl;
     }
 
+    map.store(tmp_map);
+
     return;
 }
 
 void lro_rrt_ros_node::command_callback(const geometry_msgs::PointConstPtr& msg)
 {
-    std::lock_guard<std::mutex> pose_lock(pose_update_mutex);
-
     geometry_msgs::Point pos = *msg;
 
-    goal = Eigen::Vector3d(pos.x, pos.y, pos.z);
-
+    // The search timer is idle until the mission below is published
     if (!rrt.initialized())
-        rrt.set_parameters(rrt_param);
+        for (int i = 0; i < search_trees; i++)
+            get_tree(i).set_parameters(rrt_param);
 
-    state = agent_state::PROCESS_MISSION;
+    {
+        std::lock_guard<std::mutex> commit_lock(commit_mutex);
+        mission.goal = Eigen::Vector3d(pos.x, pos.y, pos.z);
+        mission.state = agent_state::PROCESS_MISSION;
+        mission.id++;
+    }
 
     return;
 }
 
 void lro_rrt_ros_node::local_map_timer(const ros::TimerEvent &)
 {
-    std::lock_guard<std::mutex> pose_lock(pose_update_mutex);
+    agent_pose a_p = pose.load();
+    std::shared_ptr<const sensor_map> s_map = map.load();
+
+    if (!s_map)
+        return;
 
     time_point<std::chrono::system_clock> ray_timer = system_clock::now();
     pcl::PointCloud<pcl::PointXYZ>::Ptr local_cloud_current = 
-        raycast_pcl_w_fov(current_point);
+        raycast_pcl_w_fov(a_p.p, a_p.q, *s_map);
     double ray_time = duration<double>(system_clock::now() - ray_timer).count();
     // std::cout << "raycast time (" << KBLU << ray_time * 1000 << KNRM << "ms)" << std::endl;
 
-    if (!local_cloud_current->points.empty())
+    // Roll the window with the agent, then add the new hits in place
+    sliding_map.move_to(a_p.p);
+    for (pcl::PointXYZ &p : local_cloud_current->points)
+        sliding_map.insert(Eigen::Vector3d(p.x, p.y, p.z));
+
+    // Only the voxels that changed since the last tick are applied, the new
+    // version shares every untouched brick with the previous one. When nothing
+    // changed the previous map is kept as it is. The cloud is not touched here,
+    // it is built from the map when it is needed
+    sliding_map.take_changes(map_added, map_removed);
+    if (!map_added.empty() || !map_removed.empty())
     {
-        *local_cloud_current += *local_cloud;
-        sliding_map.update_pose_and_octree(
-            local_cloud_current, Eigen::Vector3d::Zero(), Eigen::Vector3d::Zero());
+        std::shared_ptr<sensor_map> tmp_map = local_map.edit();
+        for (const Eigen::Vector3d &p : map_removed)
+            tmp_map->erase(p);
+        for (const Eigen::Vector3d &p : map_added)
+            tmp_map->insert(p);
+        local_map.store(tmp_map);
     }
-
-    // Update known and unknown regions
-
-    Eigen::Vector3d voxel_center;
-    sliding_map.get_estimated_center_of_point(
-        current_point, voxel_center);
-    
-    sliding_map.extract_point_cloud_within_boundary(
-        current_point, m_p.s_m_s/2, local_cloud);
     
     double ray_n_acc_time = duration<double>(system_clock::now() - ray_timer).count();
     // std::cout << "raycast and accumulation time (" << KBLU << ray_n_acc_time * 1000 << KNRM << "ms)" << std::endl;
 
+    if (local_pcl_pub.getNumSubscribers() == 0)
+        return;
+
     sensor_msgs::PointCloud2 obstacle_msg, detailed_map_msg;
     // Publish local cloud as a ros message
-    pcl::toROSMsg(*local_cloud, obstacle_msg);
+    pcl::toROSMsg(*get_local_cloud(local_map.load()), obstacle_msg);
 
     obstacle_msg.header.frame_id = "world";
     obstacle_msg.header.stamp = ros::Time::now();
@@ -111,69 +130,88 @@ void lro_rrt_ros_node::local_map_timer(const ros::TimerEvent &)
 
 void lro_rrt_ros_node::agent_forward_timer(const ros::TimerEvent &)
 {
-    std::lock_guard<std::mutex> pose_lock(pose_update_mutex);
+    mission_status m = get_mission();
 
-    Eigen::Vector3d vel, acc;
-    if (state == agent_state::EXEC_MISSION && !emergency_stop)
+    Eigen::Vector3d vel = Eigen::Vector3d::Zero(), acc = Eigen::Vector3d::Zero();
+    if (m.state == agent_state::EXEC_MISSION && !m.emergency_stop)
     {
-        // Choose the path within the vector of trajectories
+        // Choose the path within the timeline, the cursor carries on from
+        // the previous tick unless a new timeline has been committed
         t_p_sc current_time = system_clock::now();
-        
-        am_trajectory am_segment;
-        for (am_trajectory &current_am : am)
-            if (duration<double>(current_time - current_am.s_e_t.second).count() <= 0.0)
-            {
-                am_segment = current_am;
-                break;
-            }
-
-        double t = duration<double>(current_time - am_segment.s_e_t.first).count();
-        current_point = am_segment.traj.getPos(t);
-
-        // If the agent has reached its goal
-        if ((goal - current_point).norm() < 0.2)
+        std::shared_ptr<const timeline> am = trajectories.load();
+        if (am != agent_timeline)
         {
-            am.clear();
-            state = agent_state::IDLE; 
-            is_safe = false;
-            printf("trajectory completed\n");
+            agent_timeline = am;
+            agent_cursor = 0;
         }
-        // If the agent has not reached its goal
-        else
+        const am_trajectory *am_segment = am->find(current_time, agent_cursor);
+
+        if (am_segment != nullptr)
         {
-            vel = am_segment.traj.getVel(t);
-            acc = am_segment.traj.getAcc(t);
+            double t = duration<double>(current_time - am_segment->s_e_t.first).count();
+            // Locate the piece once for position, velocity and acceleration
+            int p_idx = am_segment->traj.locatePieceIdx(t);
+            const Piece &piece = am_segment->traj[p_idx];
+            current_point = piece.getPos(t);
+
+            // If the agent has reached its goal, the finished mission
+            // releases its trajectories
+            if ((m.goal - current_point).norm() < 0.2)
+            {
+                {
+                    std::lock_guard<std::mutex> commit_lock(commit_mutex);
+                    if (mission.id == m.id)
+                    {
+                        mission.state = agent_state::IDLE;
+                        trajectories.store(std::make_shared<const timeline>());
+                    }
+                }
+                is_safe = false;
+                printf("trajectory completed\n");
+            }
+            // If the agent has not reached its goal
+            else
+            {
+                vel = piece.getVel(t);
+                acc = piece.getAcc(t);
 
-            if (vel.norm() > 0.10)
-                orientation.e.z() = atan2(vel.y(), vel.x());
+                if (vel.norm() > 0.10)
+                    orientation.e.z() = atan2(vel.y(), vel.x());
+            }
         }
     }
 
-    if (emergency_stop)
+    if (m.emergency_stop)
     {
-        double t = duration<double>(system_clock::now() - emergency_stop_time).count();
+        double t = duration<double>(system_clock::now() - m.emergency_stop_time).count();
         if (t > 1.0)
         {
-            emergency_stop = false;
-            state = agent_state::PROCESS_MISSION;
+            std::lock_guard<std::mutex> commit_lock(commit_mutex);
+            if (mission.id == m.id && mission.emergency_stop)
+            {
+                mission.emergency_stop = false;
+                mission.state = agent_state::PROCESS_MISSION;
+            }
         }
     }
     
-    geometry_msgs::PoseStamped pose;
-    pose.header.frame_id = "world";
-    pose.pose.position.x = current_point.x();
-    pose.pose.position.y = current_point.y();
-    pose.pose.position.z = current_point.z();
+    geometry_msgs::PoseStamped pose_msg;
+    pose_msg.header.frame_id = "world";
+    pose_msg.pose.position.x = current_point.x();
+    pose_msg.pose.position.y = current_point.y();
+    pose_msg.pose.position.z = current_point.z();
 
     calc_uav_orientation(
         acc, orientation.e.z(), orientation.q, orientation.r);
 
-    pose.pose.orientation.w = orientation.q.w();
-	pose.pose.orientation.x = orientation.q.x();
-	pose.pose.orientation.y = orientation.q.y();
-	pose.pose.orientation.z = orientation.q.z();
+    pose.store(agent_pose{current_point, orientation.q});
+
+    pose_msg.pose.orientation.w = orientation.q.w();
+	pose_msg.pose.orientation.x = orientation.q.x();
+	pose_msg.pose.orientation.y = orientation.q.y();
+	pose_msg.pose.orientation.z = orientation.q.z();
 
-    pose_pub.publish(pose);
+    pose_pub.publish(pose_msg);
 
     visualize_points(0.5, rrt_param.s_r*2);
 
@@ -182,105 +220,142 @@ void lro_rrt_ros_node::agent_forward_timer(const ros::TimerEvent &)
 
 void lro_rrt_ros_node::rrt_search_timer(const ros::TimerEvent &)
 {
-    std::lock_guard<std::mutex> pose_lock(pose_update_mutex);
+    mission_status m = get_mission();
 
-    if (state == agent_state::IDLE)
+    // The timeline was released by the transition to IDLE
+    if (m.state == agent_state::IDLE)
         return;
 
-    time_point<std::chrono::system_clock> timer = system_clock::now();
-    t_p_sc horizon_time = timer + milliseconds((int)round(reserve_time*1000));
+    // Hand a snapshot of everything the cycle needs to the search stage
+    planning_request request;
+    request.m = m;
+    request.timer = system_clock::now();
+    request.horizon_time = request.timer + 
+        milliseconds((int)round(reserve_time*1000));
+    request.am = trajectories.load();
+    request.point = pose.load().p;
+    // The cloud and the map of a request are always the same version
+    std::shared_ptr<const sensor_map> s_map = local_map.load();
+    request.cloud = get_local_cloud(s_map);
+    request.local_map = map_store::view(s_map, rrt_param.r);
+
+    search_queue.push(std::move(request));
+}
 
-    bool bypass = false;
-    int index;
-    t_p_sc found;
-    int offset = 0;
-    int current_cp_index, current_knot_index;
+void lro_rrt_ros_node::search_stage()
+{
+    planning_request r;
+    while (search_queue.pop(r))
+    {
+        planning_result result;
+        if (plan_search(r, result))
+            optimise_queue.push(std::move(result));
+    }
+}
 
-    AmTraj am_traj(
-        a_m_p.w_t, a_m_p.w_a, a_m_p.w_j, 
-        a_m_p.m_v, a_m_p.m_a, a_m_p.m_i, a_m_p.e);
+void lro_rrt_ros_node::update_trees(
+    const pcl::PointCloud<pcl::PointXYZ>::Ptr &cloud, 
+    const Eigen::Vector3d &start, const Eigen::Vector3d &goal)
+{
+    // Every tree builds its own octree, side by side so it takes as long as one
+    search_pool->parallel_for(search_trees, 1, [&](int begin, int end, int)
+    {
+        for (int i = begin; i < end; i++)
+            get_tree(i).update_pose_and_octree(cloud, start, goal);
+    });
+}
 
-    // Discard any unused previous trajectories in the vector
-    if (!am.empty())
+bool lro_rrt_ros_node::search_trees_for_path(vector<Eigen::Vector3d> &path)
+{
+    search_pool->parallel_for(search_trees, 1, [&](int begin, int end, int)
     {
-        while (1)
+        for (int i = begin; i < end; i++)
         {
-            if (duration<double>(
-                timer - am.front().s_e_t.second).count() > 0.0)
-                am.erase(am.begin());
-            else
-                break;
+            tree_paths[i].clear();
+            tree_success[i] = get_tree(i).get_path(tree_paths[i]);
         }
-    }
+    });
+
+    int best = select_shortest_path(tree_paths, tree_success);
+    path.swap(tree_paths[best]);
+    return tree_success[best];
+}
+
+bool lro_rrt_ros_node::plan_search(
+    const planning_request &r, planning_result &result)
+{
+    const mission_status &m = r.m;
+    const timeline &am = *r.am;
+    time_point<std::chrono::system_clock> timer = system_clock::now();
+    const t_p_sc &horizon_time = r.horizon_time;
+
+    bool bypass = false;
 
     Eigen::Vector3d start_point;
-    std::vector<Eigen::Vector3d> check_path, global_search_path;
-    int idx;
-    if (state != agent_state::PROCESS_MISSION)
+    int idx = -1;
+    double t1 = 0.0;
+    if (m.state != agent_state::PROCESS_MISSION)
     {
         // Select point after adding the time horizon
         for (idx = 0; idx < (int)am.size(); idx++)
             if (duration<double>(horizon_time - am[idx].s_e_t.second).count() < 0.0)
                 break;
+
+        if (idx == (int)am.size())
+            return false;
         
         Eigen::Vector3d point;
 
-        double t1 = duration<double>(horizon_time - am[idx].s_e_t.first).count();
+        t1 = duration<double>(horizon_time - am[idx].s_e_t.first).count();
         if (t1 > duration<double>(
             am[idx].s_e_t.second - am[idx].s_e_t.first).count())
-            return;
+            return false;
         
         point = am[idx].traj.getPos(t1);
 
-        // Update the octree with the local cloud
-        rrt.update_pose_and_octree(local_cloud, point, goal);
+        // Update the octrees with the local cloud
+        update_trees(r.cloud, point, m.goal);
         start_point = point;
-
-        // Find the possible trajectory segment it is at
-        // so as to delete the paths before
-        int p1 = am[idx].traj.locatePieceIdx(t1);
-        check_path.push_back(point);
-        for (int i = p1; i < (int)am[idx].traj.pieces.size(); i++)
-        {
-            double seg_duration = am[idx].traj.pieces[i].getDuration();
-            if (duration<double>(am[idx].s_e_t.second - 
-                am[idx].s_e_t.first).count() < seg_duration)
-                break;
-
-            check_path.push_back(
-                am[idx].traj[i].getPos(seg_duration));
-        }
-
-        for (int i = idx+1; i < (int)am.size(); i++)
-            for (int j = 0; i < (int)am[i].traj.pieces.size(); j++)
-            {
-                double seg_duration = am[i].traj.pieces[j].getDuration();
-                if (duration<double>(am[i].s_e_t.second - 
-                    am[i].s_e_t.first).count() < seg_duration)
-                    break;
-                
-                check_path.push_back(
-                    am[i].traj.pieces[j].getPos(seg_duration));
-            }
-        
     }
     // state is agent_state::PROCESS_MISSION
     else
     {
-        // Update the octree with the local cloud
-        rrt.update_pose_and_octree(local_cloud, current_point, goal);
-        start_point = current_point;
-        check_path.push_back(current_point);
+        // Update the octrees with the local cloud
+        update_trees(r.cloud, r.point, m.goal);
+        start_point = r.point;
     }
 
     double update_octree_time = duration<double>(system_clock::now() - 
         timer).count()*1000;
 
+    // Check the committed trajectories from the horizon to their end against
+    // the local map, the polynomials are sampled and not only the junctions.
+    // If they stay clear or the goal is reached, do bypass
+    bool valid = false;
+    bool reused_collided = false;
+    if (idx >= 0)
+    {
+        double collision_time = -1.0;
+        for (int i = idx; i < (int)am.size() && collision_time < 0.0; i++)
+        {
+            double t_e = duration<double>(
+                am[i].s_e_t.second - am[i].s_e_t.first).count();
+            collision_time = get_collision_time(
+                am[i].traj, i == idx ? t1 : 0.0, t_e, r.local_map, rrt_param.r);
+
+            if (collision_time >= 0.0)
+            {
+                reused_collided = am[i].reused_path;
+                std::cout << KYEL << "Trajectory collision in " << 
+                    duration<double>(am[i].s_e_t.first - r.timer).count() + 
+                    collision_time << "s" << KNRM << std::endl;
+            }
+        }
+        valid = collision_time < 0.0;
+    }
+
     double update_check_time;
-    // Check to see whether the previous data extents to the end
-    // if previous point last point connects to end point, do bypass    
-    if (rrt.get_path_validity(check_path) || 
-        (goal - start_point).norm() < 0.2)
+    if (valid || (m.goal - start_point).norm() < 0.2)
     {
         // std::cout << KCYN << "Conducting bypass" << KNRM << std::endl;
         update_check_time = duration<double>(system_clock::now() - 
@@ -292,22 +367,53 @@ void lro_rrt_ros_node::rrt_search_timer(const ros::TimerEvent &)
         update_check_time = duration<double>(system_clock::now() - 
             timer).count()*1000 - update_octree_time;
 
-        global_search_path.clear();
+        result.global_search_path.clear();
         std::vector<Eigen::Vector3d> t_g_s_p;
-        is_safe = rrt.get_path(t_g_s_p);
+
+        // The goal has not changed since the last search and its path is still
+        // clear from the new start, so there is nothing to search for. The
+        // path check only covers the straight segments, so a trajectory built
+        // on a reused path that collided anyway (overshoot) is searched again,
+        // as is a path that has been reused max_path_reuse times in a row
+        result.reused_path = !reused_collided && path_reuses < max_path_reuse &&
+            reroot_previous_path(m.id, start_point, r.local_map, rrt_param.r, t_g_s_p);
+        if (result.reused_path)
+        {
+            std::cout << KCYN << "Reusing previous path" << KNRM << std::endl;
+            path_reuses++;
+            is_safe = true;
+        }
+        else
+        {
+            if (reused_collided)
+                std::cout << KYEL << "Reused path collided, searching again" << 
+                    KNRM << std::endl;
+            path_reuses = 0;
+            is_safe = search_trees_for_path(t_g_s_p);
+        }
+
+        if (is_safe)
+        {
+            previous_path = t_g_s_p;
+            previous_path_id = m.id;
+        }
 
         if (t_g_s_p.empty())
         {
             std::cout << KRED << "Collision detected, emergency stop" << 
                 KNRM << std::endl;
-            emergency_stop = true;
-            am.clear();
-            state = agent_state::IDLE;
-            emergency_stop_time = system_clock::now();
-            return;
+            std::lock_guard<std::mutex> commit_lock(commit_mutex);
+            if (mission.id == m.id)
+            {
+                mission.emergency_stop = true;
+                mission.state = agent_state::IDLE;
+                mission.emergency_stop_time = system_clock::now();
+                trajectories.store(std::make_shared<const timeline>());
+            }
+            return false;
         }
 
-        lro_rrt_server::get_discretized_path(t_g_s_p, global_search_path);
+        lro_rrt_server::get_discretized_path(t_g_s_p, result.global_search_path);
         // for (Eigen::Vector3d &p : global_search_path)
         //     std::cout << p.transpose() << std::endl;
 
@@ -315,57 +421,176 @@ void lro_rrt_ros_node::rrt_search_timer(const ros::TimerEvent &)
             std::cout << KRED << "No global path found, " << KNRM <<
                 "using [safe path]" << std::endl;
         
-        nav_msgs::Path global_path = vector_3d_to_path(global_search_path);
+        nav_msgs::Path global_path = vector_3d_to_path(result.global_search_path);
         g_rrt_points_pub.publish(global_path);
     }
     
     std::cout << "total search time(" << KGRN <<
         duration<double>(system_clock::now() - 
         timer).count()*1000 << "ms" << KNRM << 
-        ") update_octree time(" << local_cloud->points.size() << ") (" << KGRN <<
+        ") update_octree time(" << r.cloud->points.size() << ") (" << KGRN <<
         update_octree_time << "ms" << KNRM << 
         ") update_check time(" << KGRN <<
         update_check_time << "ms" << KNRM << ")" << std::endl;
-    
-    // Only update if we have done a new RRT search
-    if (!bypass && state == agent_state::PROCESS_MISSION)
-    {
-        am_trajectory tmp_am;
-        tmp_am.traj = am_traj.genOptimalTrajDTC(
-            global_search_path, Eigen::Vector3d::Zero(), 
-            Eigen::Vector3d::Zero(), Eigen::Vector3d::Zero(), 
-            Eigen::Vector3d::Zero());
-        t_p_sc s_t = system_clock::now();
-        tmp_am.s_e_t.first = system_clock::now();
-        tmp_am.s_e_t.second = 
-            s_t + milliseconds((int)round(
-            tmp_am.traj.getTotalDuration()*1000));
-
-        am.push_back(tmp_am);
-
-        state = agent_state::EXEC_MISSION;
-    }
-    else if (!bypass && state == agent_state::EXEC_MISSION)
+
+    is_safe = true;
+
+    // Only optimise if we have done a new RRT search
+    if (bypass)
+        return false;
+
+    result.r = r;
+    result.idx = idx;
+    return true;
+}
+
+bool lro_rrt_ros_node::rebase_result(
+    const std::shared_ptr<const timeline> &base, 
+    planning_result &result, sensor_map::packet_cache &cache)
+{
+    // The first trajectory of a mission is only committed once
+    if (result.r.m.state == agent_state::PROCESS_MISSION || 
+        !base || base->empty() || result.global_search_path.size() < 2)
+        return false;
+
+    // The horizon has to fall in the latest trajectory, which is the one cut
+    const am_trajectory &last = base->back();
+    const t_p_sc &horizon_time = result.r.horizon_time;
+    if (horizon_time < last.s_e_t.first || horizon_time > last.s_e_t.second)
+        return false;
+
+    // Only the start moves to where the latest trajectory is at the horizon,
+    // the rest of the path is kept if the new first segment is clear
+    std::vector<Eigen::Vector3d> &path = result.global_search_path;
+    path[0] = last.traj.getPos(
+        duration<double>(horizon_time - last.s_e_t.first).count());
+    if (result.r.local_map.get_first_blocked_segment(
+        path.data(), 2, rrt_param.r, cache) >= 0)
+        return false;
+
+    result.r.am = base;
+    result.idx = (int)base->size() - 1;
+    return true;
+}
+
+void lro_rrt_ros_node::optimise_stage()
+{
+    // Owned by this stage only, its workspace is reused by every cycle
+    AmTraj am_traj(
+        a_m_p.w_t, a_m_p.w_a, a_m_p.w_j, 
+        a_m_p.m_v, a_m_p.m_a, a_m_p.m_i, a_m_p.e);
+
+    // Long routes have their piece durations optimized on a pool of their own,
+    // so the raycast workers never wait on a planning cycle or vice versa
+    worker_pool traj_pool(a_m_p.p_t);
+    if (traj_pool.size() > 1)
+        am_traj.setParallelFor(
+            [&traj_pool](int n, int grain, const worker_pool::task_function &fn)
+            { traj_pool.parallel_for(n, grain, fn); }, a_m_p.p_g);
+
+    sensor_map::packet_cache rebase_cache;
+    planning_result result;
+    while (optimise_queue.pop(result))
     {
-        // Since we have a new path, the previous trajectory has to shorten its end time
-        am[idx].s_e_t.second = horizon_time;
-        double get_duration = duration<double>(
-            horizon_time - am[idx].s_e_t.first).count();
+        const mission_status &m = result.r.m;
+        const t_p_sc &horizon_time = result.r.horizon_time;
+        time_point<std::chrono::system_clock> timer = system_clock::now();
+
+        // The search was started from this list, if another cycle has
+        // committed since then the result starts from the latest one instead
+        std::shared_ptr<const timeline> base = trajectories.load();
+        if (base != result.r.am && !rebase_result(base, result, rebase_cache))
+            continue;
+
+        // Only the entries are copied, the trajectories are shared
+        timeline am = *result.r.am;
+        am.prune(timer);
 
         am_trajectory tmp_am;
-        tmp_am.traj = am_traj.genOptimalTrajDTC(
-            global_search_path, am[idx].traj.getVel(get_duration), 
-            am[idx].traj.getAcc(get_duration), Eigen::Vector3d::Zero(), 
-            Eigen::Vector3d::Zero());
-        tmp_am.s_e_t.first = horizon_time;
-        tmp_am.s_e_t.second = 
-            horizon_time + milliseconds((int)round(
-            tmp_am.traj.getTotalDuration()*1000));
-    
-        am.push_back(tmp_am);
-    }
+        std::shared_ptr<const am_trajectory> cut_am;
+        int next_state = m.state;
+        if (m.state == agent_state::PROCESS_MISSION)
+        {
+            am_traj.genOptimalTrajDTC(
+                result.global_search_path, Eigen::Vector3d::Zero(), 
+                Eigen::Vector3d::Zero(), Eigen::Vector3d::Zero(), 
+                Eigen::Vector3d::Zero(), tmp_am.traj);
+            t_p_sc s_t = system_clock::now();
+            tmp_am.s_e_t.first = system_clock::now();
+            tmp_am.s_e_t.second = 
+                s_t + milliseconds((int)round(
+                tmp_am.traj.getTotalDuration()*1000));
+
+            next_state = agent_state::EXEC_MISSION;
+        }
+        else
+        {
+            // Since we have a new path, the previous trajectory has to shorten its end time
+            const am_trajectory &previous = (*result.r.am)[result.idx];
+            double get_duration = duration<double>(
+                horizon_time - previous.s_e_t.first).count();
+
+            // Warm started from the previous trajectory, the parts of the
+            // route that did not change start from their previous durations
+            am_traj.genOptimalTrajDTC(
+                previous.traj, result.global_search_path, 
+                previous.traj.getVel(get_duration), 
+                previous.traj.getAcc(get_duration), Eigen::Vector3d::Zero(), 
+                Eigen::Vector3d::Zero(), tmp_am.traj);
+            tmp_am.s_e_t.first = horizon_time;
+            tmp_am.s_e_t.second = 
+                horizon_time + milliseconds((int)round(
+                tmp_am.traj.getTotalDuration()*1000));
+
+            for (size_t i = 0; i < am.size(); i++)
+                if (am.at(i) == result.r.am->at(result.idx))
+                {
+                    std::shared_ptr<am_trajectory> cut = 
+                        std::make_shared<am_trajectory>(previous);
+                    cut->s_e_t.second = horizon_time;
+                    am.replace(i, cut);
+                    cut_am = cut;
+                }
+        }
 
-    is_safe = true;
+        tmp_am.reused_path = result.reused_path;
+        am.push_back(std::make_shared<const am_trajectory>(std::move(tmp_am)));
+
+        // Publish the trajectories before the agent can see EXEC_MISSION,
+        // a result for a goal that has been replaced meanwhile is dropped
+        std::shared_ptr<const timeline> am_ptr = 
+            std::make_shared<const timeline>(std::move(am));
+        bool committed = false;
+        {
+            std::lock_guard<std::mutex> commit_lock(commit_mutex);
+            if (mission.id == m.id && mission.state == m.state && 
+                !mission.emergency_stop && trajectories.load() == result.r.am)
+            {
+                trajectories.store(am_ptr);
+                mission.state = next_state;
+                committed = true;
+            }
+        }
+
+        // The shortened previous trajectory is logged again with its new window,
+        // every commit reaches the file before the next one
+        if (committed && trajectory_logger)
+        {
+            if (cut_am)
+                log_trajectory(*cut_am);
+            log_trajectory(am_ptr->back());
+            if (!trajectory_logger->flush())
+            {
+                std::cout << KRED << "unable to write " << trajectory_file <<
+                    ", trajectory logging stopped" << KNRM << std::endl;
+                trajectory_logger.reset();
+            }
+        }
+
+        std::cout << "trajectory time(" << KGRN <<
+            duration<double>(system_clock::now() - timer).count()*1000 << 
+            "ms" << KNRM << ")" << std::endl;
+    }
 }
 
 void lro_rrt_ros_node::calc_uav_orientation(
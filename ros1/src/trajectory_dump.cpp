@@ -0,0 +1,77 @@
+/*
+* trajectory_dump.cpp
+*
+* ---------------------------------------------------------------------
+* Copyright (C) 2022 Matthew (matthewoots at gmail.com)
+*
+*  This program is free software; you can redistribute it and/or
+*  modify it under the terms of the GNU General Public License
+*  as published by the Free Software Foundation; either version 2
+*  of the License, or (at your option) any later version.
+*
+*  This program is distributed in the hope that it will be useful,
+*  but WITHOUT ANY WARRANTY; without even the implied warranty of
+*  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*  GNU General Public License for more details.
+* ---------------------------------------------------------------------
+*/
+
+/**
+ * @brief Prints the records of a trajectory log, no ROS needed
+ * usage: lro_rrt_ros_trajectory_dump <flight.traj> [step]
+ * One line per record with its index, time window, piece count and
+ * duration, then with step > 0 one "t x y z" line every step seconds of the
+ * record, t in seconds since its start
+**/
+
+#include "trajectory_log.h"
+
+#include <string>
+#include <cstdio>
+#include <algorithm>
+#include <iostream>
+#include <Eigen/Dense>
+
+using namespace std;
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        cerr << "usage: " << argv[0] << " <flight.traj> [step]" << endl;
+        return 1;
+    }
+    double step = argc > 2 ? stod(argv[2]) : 0.0;
+
+    trajectory_log::reader log;
+    if (!log.open(argv[1]))
+    {
+        cerr << "unable to read " << argv[1] <<
+            " or it is not a log of this build" << endl;
+        return 1;
+    }
+
+    for (size_t i = 0; i < log.size(); i++)
+    {
+        trajectory_log::record_view r = log[i];
+        double total = 0.0;
+        for (int j = 0; j < r.get_piece_num(); j++)
+            total += r.get_duration(j);
+
+        printf("record %zu start %.6f end %.6f pieces %d duration %.6f\n",
+            i, r.start_time(), r.end_time(), r.get_piece_num(), total);
+
+        if (step <= 0.0 || r.get_piece_num() == 0)
+            continue;
+
+        // Only the part that was flown, a cut trajectory ends before its pieces do
+        double window = std::min(total, r.end_time() - r.start_time());
+        for (double t = 0.0; t <= window; t += step)
+        {
+            Eigen::Vector3d p = r.get_pos(t);
+            printf("%.6f %.6f %.6f %.6f\n", t, p.x(), p.y(), p.z());
+        }
+    }
+
+    return 0;
+}